@@ -0,0 +1,148 @@
+/* vi:ai:tabstop=8:shiftwidth=4:softtabstop=4:expandtab
+ *
+ * Times the filter engine on its own, without FUSE or the kernel in the way:
+ * read_config() on a config file, and the verdicts of should_hide() and
+ * evaluate_rules() on a list of recorded paths.
+ *
+ *   filter_bench CONFIG PATHS [--source DIR] [--regex-engine NAME] [--invert]
+ *                [--benchmark_... options]
+ *
+ * PATHS has one path a line, relative to the source directory, optionally
+ * preceded by its type the way find prints it with %y:
+ *
+ *   (cd SOURCE && find . -mindepth 1 -printf '%y /%P\n') > paths.txt
+ *
+ * Without a type, paths are taken for regular files. The source directory is
+ * only needed if the rules use extensionPriority, and can be given more than
+ * once, as with the source option.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "filter.h"
+
+struct recorded_path {
+    std::string path;
+    mode_t mode;
+};
+
+static mode_t find_type(char type) {
+    switch (type) {
+    case 'd': return S_IFDIR;
+    case 'l': return S_IFLNK;
+    case 'b': return S_IFBLK;
+    case 'c': return S_IFCHR;
+    case 'p': return S_IFIFO;
+    case 's': return S_IFSOCK;
+    default: return S_IFREG;
+    }
+}
+
+static std::vector<recorded_path> read_paths(const char *file) {
+    std::vector<recorded_path> paths;
+    std::ifstream in(file);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty()) continue;
+        recorded_path p = { line, S_IFREG };
+        if (line.size() > 2 && line[1] == ' ') {
+            p.mode = find_type(line[0]);
+            p.path.erase(0, 2);
+        }
+        if (p.path[0] != '/') p.path.insert(0, 1, '/');
+        paths.push_back(std::move(p));
+    }
+    return paths;
+}
+
+static std::shared_ptr<filter_set> load_rules(const char *config) {
+    auto fs = std::make_shared<filter_set>();
+    if (read_config(config, *fs)) {
+        fprintf(stderr, "filter_bench: can not read %s\n", config);
+        exit(1);
+    }
+    return fs;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: filter_bench CONFIG PATHS [--source DIR] [--regex-engine NAME] [--invert]"
+                    " [--benchmark_... options]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    benchmark::Initialize(&argc, argv);
+
+    std::vector<const char *> args;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg[0] != '-') args.push_back(argv[i]);
+        else if (arg == "--invert") conf.invert = 1;
+        else if (i + 1 == argc) usage();
+        else if (arg == "--source") {
+            const char *source = argv[++i];
+            int res = add_branch(source);
+            if (res) {
+                fprintf(stderr, "filter_bench: can not open %s: %s\n", source, strerror(-res));
+                return 1;
+            }
+        }
+        else if (arg == "--regex-engine") conf.regex_engine = argv[++i];
+        else usage();
+    }
+    if (args.size() != 2) usage();
+    const char *config = args[0];
+
+    const std::vector<recorded_path> paths = read_paths(args[1]);
+    if (paths.empty()) {
+        fprintf(stderr, "filter_bench: no paths in %s\n", args[1]);
+        return 1;
+    }
+    publish_filters(load_rules(config));
+
+    auto per_path = [&](benchmark::State &state) {
+        state.SetItemsProcessed(state.iterations() * paths.size());
+        state.counters["per_path"] = benchmark::Counter(paths.size(),
+                benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kAvgThreads
+                | benchmark::Counter::kInvert);
+    };
+
+    benchmark::RegisterBenchmark("read_config", [&](benchmark::State &state) {
+        for (auto _ : state) benchmark::DoNotOptimize(load_rules(config));
+    });
+
+    // The rules alone, as --build-index runs them
+    benchmark::RegisterBenchmark("evaluate_rules", [&](benchmark::State &state) {
+        filter_ref fs;
+        for (auto _ : state) {
+            for (const auto &p : paths) {
+                benchmark::DoNotOptimize(evaluate_rules(*fs, p.path.c_str(), p.mode, NULL));
+            }
+        }
+        per_path(state);
+    });
+
+    // What the callbacks go through, with the directory verdicts cached
+    benchmark::RegisterBenchmark("should_hide", [&](benchmark::State &state) {
+        for (auto _ : state) {
+            for (const auto &p : paths) {
+                benchmark::DoNotOptimize(should_hide(p.path.c_str(), p.mode));
+            }
+        }
+        per_path(state);
+    })->ThreadRange(1, 8)->UseRealTime();
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
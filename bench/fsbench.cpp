@@ -0,0 +1,157 @@
+/* vi:ai:tabstop=8:shiftwidth=4:softtabstop=4:expandtab
+ *
+ * Measures what a media scanner and a player put a file system through:
+ * walking a tree with readdir(), lstat()ing everything that was found, and
+ * reading a file sequentially and at random offsets.
+ *
+ *   fsbench DIR FILE [--threads N] [--block KB] [--passes N]
+ *
+ * Prints the best result of --passes runs of each test as JSON.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct bench_options {
+    unsigned threads = 8;       //< lstat() storm concurrency
+    size_t block = 128 << 10;   //< Read size
+    unsigned passes = 3;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void die(const char *what, const std::string &path) {
+    fprintf(stderr, "fsbench: %s %s: %s\n", what, path.c_str(), strerror(errno));
+    exit(1);
+}
+
+/** Walk "dir" depth first, collecting the paths of everything in it */
+static void walk(const std::string &dir, std::vector<std::string> &paths) {
+    DIR *dp = opendir(dir.c_str());
+    if (dp == NULL) die("can not open", dir);
+
+    std::vector<std::string> subdirs;
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        paths.push_back(dir + "/" + de->d_name);
+
+        bool is_dir = de->d_type == DT_DIR;
+        struct stat st;
+        if (de->d_type == DT_UNKNOWN && lstat(paths.back().c_str(), &st) == 0) is_dir = S_ISDIR(st.st_mode);
+        if (is_dir) subdirs.push_back(paths.back());
+    }
+    closedir(dp);
+
+    for (const auto &sub : subdirs) walk(sub, paths);
+}
+
+/** lstat() all the paths from "threads" threads at once */
+static void stat_all(const std::vector<std::string> &paths, unsigned threads) {
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            struct stat st;
+            for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < paths.size(); ) {
+                if (lstat(paths[i].c_str(), &st)) die("can not stat", paths[i]);
+            }
+        });
+    }
+    for (auto &w : workers) w.join();
+}
+
+/** Read all of "file" in blocks, in order or shuffled.
+ * @return The number of bytes read */
+static size_t read_file(const std::string &file, size_t block, bool shuffled) {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) die("can not open", file);
+
+    struct stat st;
+    if (fstat(fd, &st)) die("can not stat", file);
+
+    std::vector<off_t> offsets;
+    for (off_t off = 0; off < st.st_size; off += block) offsets.push_back(off);
+    if (shuffled) std::shuffle(offsets.begin(), offsets.end(), std::mt19937(1));
+    else posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::vector<char> buf(block);
+    size_t total = 0;
+    for (off_t off : offsets) {
+        ssize_t n = pread(fd, buf.data(), block, off);
+        if (n == -1) die("can not read", file);
+        total += n;
+    }
+    close(fd);
+    return total;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: fsbench DIR FILE [--threads N] [--block KB] [--passes N]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    bench_options opts;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg[0] != '-') {
+            args.push_back(arg);
+            continue;
+        }
+        if (i + 1 == argc) usage();
+        const char *value = argv[++i];
+        if (arg == "--threads") opts.threads = std::max(1, atoi(value));
+        else if (arg == "--block") opts.block = (size_t)std::max(1, atoi(value)) << 10;
+        else if (arg == "--passes") opts.passes = std::max(1, atoi(value));
+        else usage();
+    }
+    if (args.size() != 2) usage();
+    const std::string &dir = args[0], &file = args[1];
+
+    double readdir_rate = 0, stat_rate = 0, seq_rate = 0, rand_rate = 0;
+    size_t entries = 0;
+    for (unsigned pass = 0; pass < opts.passes; pass++) {
+        std::vector<std::string> paths;
+        auto start = std::chrono::steady_clock::now();
+        walk(dir, paths);
+        readdir_rate = std::max(readdir_rate, paths.size() / seconds_since(start));
+        entries = paths.size();
+
+        start = std::chrono::steady_clock::now();
+        stat_all(paths, opts.threads);
+        stat_rate = std::max(stat_rate, paths.size() / seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        size_t bytes = read_file(file, opts.block, false);
+        seq_rate = std::max(seq_rate, bytes / seconds_since(start) / 1e6);
+
+        start = std::chrono::steady_clock::now();
+        bytes = read_file(file, opts.block, true);
+        rand_rate = std::max(rand_rate, bytes / seconds_since(start) / 1e6);
+    }
+
+    printf("{\"entries\": %zu, \"readdir_entries_per_s\": %.0f, \"stat_per_s\": %.0f, "
+           "\"seq_read_mb_per_s\": %.1f, \"rand_read_mb_per_s\": %.1f}\n",
+           entries, readdir_rate, stat_rate, seq_rate, rand_rate);
+    return 0;
+}
@@ -0,0 +1,134 @@
+/* vi:ai:tabstop=8:shiftwidth=4:softtabstop=4:expandtab
+ *
+ * Builds a synthetic source tree for the benchmarks: every directory down to
+ * --depth has --fanout subdirectories and --files files. Each file stem gets
+ * every extension of --ext with the given probability (and at least one), so
+ * the tree has as many same-stem siblings as the extensionPriority rules
+ * being measured need.
+ *
+ *   make_tree DIR [--depth N] [--fanout N] [--files N] [--size BYTES]
+ *                 [--ext flac=0.5,mp3=0.8,jpg=0.1] [--seed N]
+ *
+ * Prints the number of directories and files it made as JSON.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct tree_spec {
+    unsigned depth = 3;
+    unsigned fanout = 4;
+    unsigned files = 32;
+    off_t size = 0;     //< Of every file, sparse
+    std::vector<std::pair<std::string, double>> extensions = { { "flac", 0.5 }, { "mp3", 0.8 } };
+    unsigned seed = 1;
+};
+
+struct tree_counts {
+    unsigned long dirs = 0;
+    unsigned long files = 0;
+};
+
+static void die(const char *what, const std::string &path) {
+    fprintf(stderr, "make_tree: %s %s: %s\n", what, path.c_str(), strerror(errno));
+    exit(1);
+}
+
+static bool parse_extensions(const char *arg, std::vector<std::pair<std::string, double>> &out) {
+    out.clear();
+    std::string list(arg);
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos) end = list.size();
+        std::string item = list.substr(begin, end - begin);
+        size_t eq = item.find('=');
+        double p = eq == std::string::npos ? 1 : atof(item.c_str() + eq + 1);
+        std::string ext = item.substr(0, eq);
+        if (ext.empty() || p < 0 || p > 1) return false;
+        out.emplace_back(ext, p);
+        begin = end + 1;
+    }
+    return !out.empty();
+}
+
+static void make_file(const std::string &path, off_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) die("can not create", path);
+    if (size && ftruncate(fd, size)) die("can not size", path);
+    close(fd);
+}
+
+static void make_dir(const tree_spec &spec, const std::string &dir, unsigned depth,
+                     std::mt19937 &rng, tree_counts &counts) {
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST) die("can not create", dir);
+    counts.dirs++;
+
+    std::uniform_real_distribution<double> coin(0, 1);
+    char name[64];
+    for (unsigned f = 0; f < spec.files; f++) {
+        snprintf(name, sizeof(name), "/track%04u.", f);
+        const size_t first = rng() % spec.extensions.size();
+        for (size_t e = 0; e < spec.extensions.size(); e++) {
+            if (e != first && coin(rng) >= spec.extensions[e].second) continue;
+            make_file(dir + name + spec.extensions[e].first, spec.size);
+            counts.files++;
+        }
+    }
+
+    if (depth == 0) return;
+    for (unsigned d = 0; d < spec.fanout; d++) {
+        snprintf(name, sizeof(name), "/dir%03u", d);
+        make_dir(spec, dir + name, depth - 1, rng, counts);
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: make_tree DIR [--depth N] [--fanout N] [--files N] [--size BYTES]\n"
+                    "                 [--ext EXT[=P],...] [--seed N]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    tree_spec spec;
+    const char *dir = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg[0] != '-') {
+            if (dir) usage();
+            dir = argv[i];
+            continue;
+        }
+        if (i + 1 == argc) usage();
+        const char *value = argv[++i];
+        if (arg == "--depth") spec.depth = atoi(value);
+        else if (arg == "--fanout") spec.fanout = atoi(value);
+        else if (arg == "--files") spec.files = atoi(value);
+        else if (arg == "--size") spec.size = atoll(value);
+        else if (arg == "--seed") spec.seed = atoi(value);
+        else if (arg == "--ext") {
+            if (!parse_extensions(value, spec.extensions)) usage();
+        } else usage();
+    }
+    if (dir == NULL) usage();
+
+    std::mt19937 rng(spec.seed);
+    tree_counts counts;
+    make_dir(spec, dir, spec.depth, rng, counts);
+
+    printf("{\"depth\": %u, \"fanout\": %u, \"files_per_dir\": %u, \"dirs\": %lu, \"files\": %lu}\n",
+           spec.depth, spec.fanout, spec.files, counts.dirs, counts.files);
+    return 0;
+}
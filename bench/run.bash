@@ -0,0 +1,96 @@
+#!/bin/bash
+#
+# Mount a synthetic tree with rofs-filtered, run fsbench on the mount and on
+# the tree itself (through a bind mount when run as root), and write both
+# results out as JSON. Used by the "bench" target.
+#
+#   run.bash -x rofs-filtered -m make_tree -b fsbench [-o results.json]
+#            [-d depth] [-f fanout] [-n files] [-s read_size_mb] [-p passes]
+
+EXE=rofs-filtered
+MAKE_TREE=make_tree
+FSBENCH=fsbench
+OUT=/dev/stdout
+DEPTH=3
+FANOUT=6
+FILES=64
+READ_MB=256
+PASSES=3
+
+eval set -- $(getopt 'x:m:b:o:d:f:n:s:p:' "$@")
+for ((;;)); do
+  case "$1" in
+    -x)  EXE="$2";  shift 2;;
+    -m)  MAKE_TREE="$2";  shift 2;;
+    -b)  FSBENCH="$2";  shift 2;;
+    -o)  OUT="$2";  shift 2;;
+    -d)  DEPTH="$2";  shift 2;;
+    -f)  FANOUT="$2";  shift 2;;
+    -n)  FILES="$2";  shift 2;;
+    -s)  READ_MB="$2";  shift 2;;
+    -p)  PASSES="$2";  shift 2;;
+    --) shift; break;;
+    *) echo >&2 "Internal error! ($1)"; exit 1;;
+  esac
+done
+
+WORK=$(mktemp -d /tmp/rofs-filtered.bench.XXXXXX) || exit 1
+SRC_DIR="$WORK"/source
+MNT="$WORK"/mnt
+BIND="$WORK"/bind
+METRICS="$WORK"/metrics.prom
+mkdir -p "$MNT" "$BIND"
+
+cleanup() {
+  fusermount -u "$MNT" 2>/dev/null || umount "$MNT" 2>/dev/null
+  umount "$BIND" 2>/dev/null
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# With jpgs too, for the literal rule of bench.rc to have something to hide
+TREE=$("$MAKE_TREE" "$SRC_DIR" --depth $DEPTH --fanout $FANOUT --files $FILES \
+  --ext flac=0.5,mp3=0.8,jpg=0.1) || exit 1
+# Something to read, which the rules let through
+head -c ${READ_MB}M /dev/urandom > "$SRC_DIR"/stream.flac || exit 1
+
+"$EXE" "$MNT" -o source="$SRC_DIR" -o config="$(dirname "$0")"/bench.rc \
+  -o metrics_file="$METRICS",metrics_interval=0.2 || exit 1
+for ((i = 0; i < 50; i++)); do
+  [ -e "$MNT"/stream.flac ] && break
+  sleep 0.1
+done
+
+# The baseline: the same tree without FUSE in between
+NATIVE_DIR="$SRC_DIR"
+BASELINE=source
+if [ "$(id -u)" == 0 ] && mount --bind "$SRC_DIR" "$BIND" 2>/dev/null; then
+  NATIVE_DIR="$BIND"
+  BASELINE=bind_mount
+fi
+
+NATIVE=$("$FSBENCH" "$NATIVE_DIR" "$NATIVE_DIR"/stream.flac --passes $PASSES) || exit 1
+ROFS=$("$FSBENCH" "$MNT" "$MNT"/stream.flac --passes $PASSES) || exit 1
+
+# How long rofs-filtered took to read and filter the listings, per path it
+# decided on, from its own metrics
+sleep 0.5
+FILTER_NS=$(awk '
+  /^rofs_filtered_request_duration_seconds_sum\{op="opendir"\}/ { sum = $2 }
+  /^rofs_filtered_verdicts_total\{/ { paths += $2 }
+  END { printf "%.0f", paths ? sum * 1e9 / paths : 0 }' "$METRICS")
+
+VERSION=$("$EXE" --version 2>&1 | sed -n 's/.*version: //p' | head -1)
+
+cat > "$OUT" <<EOF
+{
+  "version": "$VERSION",
+  "date": "$(date -u +%Y-%m-%dT%H:%M:%SZ)",
+  "tree": $TREE,
+  "read_size_mb": $READ_MB,
+  "baseline": "$BASELINE",
+  "native": $NATIVE,
+  "rofs_filtered": $ROFS,
+  "filter_ns_per_path": $FILTER_NS
+}
+EOF
@@ -0,0 +1,23 @@
+# Find the liburing includes and library
+#
+#  LIBURING_INCLUDE_DIR - where to find liburing.h, etc.
+#  LIBURING_LIBRARIES   - List of libraries when using liburing.
+#  LIBURING_FOUND       - True if liburing is found.
+
+# check if already in cache, be silent
+if (LIBURING_INCLUDE_DIR)
+        SET (LibUring_FIND_QUIETLY TRUE)
+endif (LIBURING_INCLUDE_DIR)
+
+# find includes
+find_path (LIBURING_INCLUDE_DIR liburing.h
+        PATHS /opt /opt/local /usr/pkg)
+
+# find lib
+find_library (LIBURING_LIBRARIES NAMES uring)
+
+include ("FindPackageHandleStandardArgs")
+find_package_handle_standard_args ("LibUring" DEFAULT_MSG
+    LIBURING_INCLUDE_DIR LIBURING_LIBRARIES)
+
+mark_as_advanced (LIBURING_INCLUDE_DIR LIBURING_LIBRARIES)
@@ -0,0 +1,23 @@
+# Find the RE2 includes and library
+#
+#  RE2_INCLUDE_DIR - where to find re2/re2.h, etc.
+#  RE2_LIBRARIES   - List of libraries when using RE2.
+#  RE2_FOUND       - True if RE2 lib is found.
+
+# check if already in cache, be silent
+if (RE2_INCLUDE_DIR)
+        SET (RE2_FIND_QUIETLY TRUE)
+endif (RE2_INCLUDE_DIR)
+
+# find includes
+find_path (RE2_INCLUDE_DIR re2/re2.h
+        PATHS /opt /opt/local /usr/pkg)
+
+# find lib
+find_library (RE2_LIBRARIES NAMES re2)
+
+include ("FindPackageHandleStandardArgs")
+find_package_handle_standard_args ("RE2" DEFAULT_MSG
+    RE2_INCLUDE_DIR RE2_LIBRARIES)
+
+mark_as_advanced (RE2_INCLUDE_DIR RE2_LIBRARIES)
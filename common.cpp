@@ -0,0 +1,489 @@
+/* vi:ai:tabstop=8:shiftwidth=4:softtabstop=4:expandtab
+ *
+ * The options, logging and metrics of rofs-filtered, shared by the FUSE
+ * callbacks and the filter engine. See rofs-filtered.cpp for the license.
+ */
+
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#include "ring_buffer.h"
+#include "trace.h"
+
+struct rofs_config conf;
+int rw_fd = -1;
+std::vector<source_branch> branches;
+
+int add_branch(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return -errno;
+
+    branches.push_back({ fd, std::filesystem::absolute(path).string() });
+    if (branches.size() == 1) rw_fd = fd;
+    return 0;
+}
+
+static bool later(const struct timespec &a, const struct timespec &b) {
+    return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+int source_stat(const char *relpath, struct stat *st, int flags, unsigned *branch) {
+    if (branches.size() == 1) {
+        if (branch) *branch = 0;
+        return fstatat(rw_fd, relpath, st, flags);
+    }
+
+    int first_errno = ENOENT;
+    for (size_t b = 0; b < branches.size(); b++) {
+        if (fstatat(branches[b].fd, relpath, st, flags)) {
+            if (b == 0) first_errno = errno;
+            continue;
+        }
+        if (branch) *branch = b;
+
+        if (S_ISDIR(st->st_mode)) {
+            struct stat other;
+            for (size_t o = b + 1; o < branches.size(); o++) {
+                if (fstatat(branches[o].fd, relpath, &other, flags) == 0 && S_ISDIR(other.st_mode)
+                        && later(other.st_mtim, st->st_mtim)) {
+                    st->st_mtim = other.st_mtim;
+                }
+            }
+        }
+        return 0;
+    }
+    errno = first_errno;
+    return -1;
+}
+
+int stat_type(int dirfd, const char *relpath, mode_t *mode, int flags) {
+#if defined(STATX_TYPE)
+    // Set once statx() turned out not to be there (kernels before 4.11), or
+    // to be refused with EPERM by a seccomp filter that doesn't know it. Both
+    // last as long as the process, so fstatat() is used from then on.
+    static std::atomic<bool> no_statx(false);
+    if (!no_statx.load(std::memory_order_relaxed)) {
+        struct statx stx;
+        if (statx(dirfd, relpath, flags | AT_STATX_DONT_SYNC, STATX_TYPE, &stx) == 0) {
+            if (stx.stx_mask & STATX_TYPE) {
+                *mode = stx.stx_mode;
+                return 0;
+            }
+        } else if (errno == ENOSYS || errno == EPERM) {
+            no_statx.store(true, std::memory_order_relaxed);
+        } else {
+            return -1;
+        }
+    }
+#endif
+    struct stat st;
+    if (fstatat(dirfd, relpath, &st, flags)) return -1;
+    *mode = st.st_mode;
+    return 0;
+}
+
+int source_type(const char *relpath, mode_t *mode, int flags, unsigned *branch) {
+    int first_errno = ENOENT;
+    for (size_t b = 0; b < branches.size(); b++) {
+        if (stat_type(branches[b].fd, relpath, mode, flags) == 0) {
+            if (branch) *branch = b;
+            return 0;
+        }
+        if (b == 0) first_errno = errno;
+    }
+    errno = first_errno;
+    return -1;
+}
+
+int source_fd(const char *relpath) {
+    if (branches.size() == 1) return rw_fd;
+
+    mode_t mode;
+    for (const auto &b : branches) {
+        if (stat_type(b.fd, relpath, &mode, AT_SYMLINK_NOFOLLOW) == 0) return b.fd;
+    }
+    return rw_fd;
+}
+
+std::vector<source_view> views;
+
+int path_view(const char *path, const char **rest) {
+    if (views.empty()) {
+        if (rest) *rest = path;
+        return 0;
+    }
+
+    while (*path == '/') path++;
+    const size_t len = strcspn(path, "/");
+    for (size_t v = 0; v < views.size(); v++) {
+        if (views[v].name.size() == len && memcmp(views[v].name.data(), path, len) == 0) {
+            if (rest) *rest = path[len] ? path + len : "/";
+            return v;
+        }
+    }
+    if (rest) *rest = NULL;
+    return -1;
+}
+
+const char *translate_path(const char *path) {
+    static thread_local std::string trpath;
+    unsigned branch = 0;
+    mode_t mode;
+    if (branches.size() > 1) source_type(relative_path(path), &mode, AT_SYMLINK_NOFOLLOW, &branch);
+    trpath.assign(branches[branch].path);
+    trpath.append("/").append(relative_path(path));
+    return trpath.c_str();
+}
+
+/******************************
+ *
+ * Logging
+ *
+ ******************************/
+
+/** A message waiting to be written out by log_thread */
+struct log_record {
+    int level;
+    char msg[512];
+};
+
+static const size_t log_ring_size = 16384;
+static ring_buffer<log_record, log_ring_size> *log_ring;
+static ring_wakeup log_wakeup;     //< Active while log_thread is running
+static std::atomic<unsigned long> log_dropped;
+static std::thread log_thread;
+
+void log_msg(const int level, const char *format, ... /*args*/) {
+    if (level == LOG_DEBUG && !conf.debug) return;
+
+    va_list ap;
+
+    if (log_wakeup.enter()) {
+        // Let log_thread wait on syslog and stderr instead of the caller
+        va_start(ap, format);
+        bool queued = log_ring->push([&](log_record &record) {
+            record.level = level;
+            vsnprintf(record.msg, sizeof(record.msg), format, ap);
+        });
+        va_end(ap);
+
+        // Debug messages can be lost if the ring overflows, others can't
+        if (!queued && level == LOG_DEBUG) log_dropped.fetch_add(1, std::memory_order_relaxed);
+        log_wakeup.leave();
+        if (queued || level == LOG_DEBUG) return;
+    }
+
+    va_start(ap, format);
+    vsyslog(log_facility | level, format, ap);
+    va_end(ap);
+
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+/** Write out the queued messages, sleeping while there are none, until
+ * stop_log_thread() */
+static void log_loop() {
+    std::string batch;
+
+    auto write_out = [&]() {
+        while (log_ring->pop([&](log_record &record) {
+            syslog(log_facility | record.level, "%s", record.msg);
+            batch += record.msg;
+            batch += '\n';
+        })) {}
+
+        unsigned long dropped = log_dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "%lu debug messages were dropped", dropped);
+            syslog(log_facility | LOG_WARNING, "%s", msg);
+            batch += msg;
+            batch += '\n';
+        }
+
+        if (!batch.empty()) {
+            fwrite(batch.data(), 1, batch.size(), stderr);
+            batch.clear();
+        }
+    };
+
+    while (log_wakeup.wait([]() { return log_ring->empty(); })) write_out();
+    // What was queued while stopping
+    write_out();
+}
+
+void start_log_thread() {
+    if (!conf.debug || log_thread.joinable()) return;
+
+    log_ring = new ring_buffer<log_record, log_ring_size>();
+    log_thread = std::thread(log_loop);
+    log_wakeup.start();
+}
+
+void stop_log_thread() {
+    if (!log_thread.joinable()) return;
+
+    log_wakeup.stop();
+    log_thread.join();
+}
+
+/******************************
+ *
+ * Metrics
+ *
+ ******************************/
+
+rofs_metrics metrics;
+
+const char *const op_names[OP_COUNT] = {
+    "lookup", "getattr", "readlink", "open", "read", "opendir", "readdir",
+    "statfs", "access", "getxattr", "listxattr",
+};
+
+std::string metrics_text() {
+    rofs_metrics::totals t;
+    metrics.collect(t);
+
+    std::string text;
+    char line[256];
+    auto add = [&](const char *format, auto... args) {
+        snprintf(line, sizeof(line), format, args...);
+        text += line;
+    };
+    auto counter = [&](const char *name, const char *help) {
+        add("# HELP rofs_filtered_%s %s\n# TYPE rofs_filtered_%s counter\n", name, help, name);
+    };
+
+    text += "# HELP rofs_filtered_request_duration_seconds Time spent serving file system calls\n"
+            "# TYPE rofs_filtered_request_duration_seconds histogram\n";
+    for (size_t op = 0; op < OP_COUNT; op++) {
+        const auto &h = t.histograms[op];
+        uint64_t count = 0;
+        for (size_t b = 0; b < rofs_metrics::buckets; b++) {
+            count += h.count[b];
+            if (b + 1 < rofs_metrics::buckets) {
+                add("rofs_filtered_request_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                    op_names[op], (double)(1ULL << b) / 1e6, (unsigned long long)count);
+            } else {
+                add("rofs_filtered_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+                    op_names[op], (unsigned long long)count);
+            }
+        }
+        add("rofs_filtered_request_duration_seconds_sum{op=\"%s\"} %.9f\n", op_names[op], h.sum_ns / 1e9);
+        add("rofs_filtered_request_duration_seconds_count{op=\"%s\"} %llu\n", op_names[op], (unsigned long long)count);
+    }
+
+    const auto value = [&](unsigned metric) { return (unsigned long long)t.counters[metric]; };
+
+    counter("verdicts_total", "Paths checked against the rules, by outcome");
+    add("rofs_filtered_verdicts_total{verdict=\"hidden\"} %llu\n", value(METRIC_HIDDEN));
+    add("rofs_filtered_verdicts_total{verdict=\"shown\"} %llu\n", value(METRIC_SHOWN));
+
+    counter("verdict_sources_total", "Where the verdicts that were not cached came from");
+    add("rofs_filtered_verdict_sources_total{source=\"rules\"} %llu\n", value(METRIC_RULE_EVALUATIONS));
+    add("rofs_filtered_verdict_sources_total{source=\"index\"} %llu\n", value(METRIC_INDEX_VERDICTS));
+
+    counter("pattern_matches_total", "Paths that matched a pattern, by matcher");
+    add("rofs_filtered_pattern_matches_total{matcher=\"literal\"} %llu\n", value(METRIC_LITERAL_MATCHES));
+    add("rofs_filtered_pattern_matches_total{matcher=\"regex\"} %llu\n", value(METRIC_REGEX_MATCHES));
+
+    const struct { const char *name; unsigned hits, misses; } caches[] = {
+        { "attr", METRIC_ATTR_CACHE_HITS, METRIC_ATTR_CACHE_MISSES },
+        { "dir_index", METRIC_DIR_INDEX_HITS, METRIC_DIR_INDEX_MISSES },
+        { "dir_verdict", METRIC_DIR_VERDICT_HITS, METRIC_DIR_VERDICT_MISSES },
+    };
+    counter("cache_lookups_total", "Cache lookups, by cache and result");
+    for (const auto &cache : caches) {
+        add("rofs_filtered_cache_lookups_total{cache=\"%s\",result=\"hit\"} %llu\n", cache.name, value(cache.hits));
+        add("rofs_filtered_cache_lookups_total{cache=\"%s\",result=\"miss\"} %llu\n", cache.name, value(cache.misses));
+    }
+
+    counter("read_bytes_total", "File data served");
+    add("rofs_filtered_read_bytes_total %llu\n", value(METRIC_READ_BYTES));
+
+    counter("prefetched_bytes_total", "File data the source was asked to fetch ahead of the readers");
+    add("rofs_filtered_prefetched_bytes_total %llu\n", value(METRIC_PREFETCHED_BYTES));
+    return text;
+}
+
+int metrics_xattr_value(char *value, size_t size) {
+    std::string text = metrics_text();
+    if (size == 0) return text.size();
+    if (size < text.size()) return -ERANGE;
+    memcpy(value, text.data(), text.size());
+    return text.size();
+}
+
+static std::thread metrics_thread;
+static std::mutex metrics_thread_lock;
+static std::condition_variable metrics_thread_wake;
+static bool metrics_thread_quit;    //< Guarded by metrics_thread_lock
+
+/** Replace the metrics_file with the current metrics */
+static void write_metrics_file() {
+    std::string tmp = std::string(conf.metrics_file) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "we");
+    if (f == NULL) {
+        log_msg(LOG_ERR, "%s: Can not write %s: %s", PACKAGE_STRING, tmp.c_str(), strerror(errno));
+        return;
+    }
+
+    std::string text = metrics_text();
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    if (fclose(f)) ok = false;
+    if (!ok || rename(tmp.c_str(), conf.metrics_file)) {
+        log_msg(LOG_ERR, "%s: Can not write %s: %s", PACKAGE_STRING, conf.metrics_file, strerror(errno));
+        unlink(tmp.c_str());
+    }
+}
+
+void start_metrics_thread() {
+    if (conf.metrics_file == NULL || metrics_thread.joinable()) return;
+
+    metrics_thread = std::thread([]() {
+        const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(conf.metrics_interval));
+        std::unique_lock<std::mutex> guard(metrics_thread_lock);
+        for (;;) {
+            bool quit = metrics_thread_wake.wait_for(guard, interval, []() { return metrics_thread_quit; });
+            guard.unlock();
+            write_metrics_file();
+            if (quit) return;
+            guard.lock();
+        }
+    });
+}
+
+void stop_metrics_thread() {
+    if (!metrics_thread.joinable()) return;
+
+    {
+        std::lock_guard<std::mutex> guard(metrics_thread_lock);
+        metrics_thread_quit = true;
+    }
+    metrics_thread_wake.notify_one();
+    metrics_thread.join();
+}
+
+
+/******************************
+ *
+ * Tracing
+ *
+ ******************************/
+
+/** A call waiting to be written out by trace_thread */
+struct trace_cell {
+    trace_format::record record;
+    char path[1024 - sizeof(trace_format::record)];
+};
+
+static const size_t trace_ring_size = 8192;
+static ring_buffer<trace_cell, trace_ring_size> *trace_ring;
+static ring_wakeup trace_wakeup;   //< Active while trace_thread is running
+static std::atomic<unsigned long> trace_dropped;
+static uint64_t trace_start_ns;
+static FILE *trace_file;
+static std::thread trace_thread;
+
+void trace_call(unsigned op, const char *path, uint64_t offset, uint64_t size, uint64_t start, uint64_t end) {
+    if (!trace_wakeup.enter()) return;
+
+    size_t len = path ? strlen(path) : 0;
+    bool queued = len <= sizeof(trace_cell::path) && trace_ring->push([&](trace_cell &cell) {
+        trace_format::record &r = cell.record;
+        memset(&r, 0, sizeof(r));
+        r.start_ns = start > trace_start_ns ? start - trace_start_ns : 0;
+        r.offset = offset;
+        r.size = size > UINT32_MAX ? UINT32_MAX : size;
+        r.duration_ns = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+        r.path_len = len;
+        r.op = op;
+        memcpy(cell.path, path, len);
+    });
+    if (!queued) trace_dropped.fetch_add(1, std::memory_order_relaxed);
+    trace_wakeup.leave();
+}
+
+/** Write out the queued calls.
+ * @return false if the trace could not be written */
+static bool write_trace() {
+    bool ok = true;
+    while (trace_ring->pop([&](trace_cell &cell) {
+        ok = fwrite(&cell.record, sizeof(cell.record), 1, trace_file) == 1
+                && fwrite(cell.path, 1, cell.record.path_len, trace_file) == cell.record.path_len && ok;
+    })) {}
+    if (fflush(trace_file) || !ok) {
+        log_msg(LOG_ERR, "%s: Can not write the trace %s: %s", PACKAGE_STRING, conf.trace, strerror(errno));
+        trace_wakeup.close();
+        return false;
+    }
+    return true;
+}
+
+/** Write out the queued calls, sleeping while there are none, until
+ * stop_trace_thread() or a write error */
+static void trace_loop() {
+    while (trace_wakeup.wait([]() { return trace_ring->empty(); })) {
+        if (!write_trace()) return;
+    }
+    // What was queued while stopping
+    write_trace();
+}
+
+void start_trace_thread() {
+    if (conf.trace == NULL || trace_thread.joinable()) return;
+
+    trace_file = fopen(conf.trace, "we");
+    if (trace_file == NULL) {
+        log_msg(LOG_ERR, "%s: Can not write the trace %s: %s", PACKAGE_STRING, conf.trace, strerror(errno));
+        return;
+    }
+
+    trace_format::header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, trace_format::magic, sizeof(header.magic));
+    header.byte_order = trace_format::byte_order;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.start_sec = now.tv_sec;
+    header.start_nsec = now.tv_nsec;
+    trace_start_ns = now_ns();
+    if (fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+        log_msg(LOG_ERR, "%s: Can not write the trace %s: %s", PACKAGE_STRING, conf.trace, strerror(errno));
+        fclose(trace_file);
+        return;
+    }
+
+    trace_ring = new ring_buffer<trace_cell, trace_ring_size>();
+    trace_thread = std::thread(trace_loop);
+    trace_wakeup.start();
+}
+
+void stop_trace_thread() {
+    if (!trace_thread.joinable()) return;
+
+    trace_wakeup.stop();
+    trace_thread.join();
+    fclose(trace_file);
+
+    unsigned long dropped = trace_dropped.load(std::memory_order_relaxed);
+    if (dropped) {
+        log_msg(LOG_WARNING, "%s: %lu calls were left out of the trace %s", PACKAGE_STRING, dropped, conf.trace);
+    }
+}
@@ -0,0 +1,305 @@
+#pragma once
+
+/**
+What every part of rofs-filtered shares: the options, the source directory,
+logging and metrics. The filter engine (filter.h) only depends on this, so it
+can be linked without FUSE, into the benchmarks for instance.
+*/
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#if __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+
+// Some hard-coded values for use with syslog
+static const char *const EXEC_NAME = "rofs-filtered";
+static const int log_facility = LOG_DAEMON;
+
+struct rofs_config {
+    const char *rw_path;
+    const char *config;
+    int invert;
+    int debug;
+    int preserve_perms;
+    int splice_read;
+    double attr_cache_ttl;
+    unsigned attr_cache_max_entries;
+    const char *regex_engine;
+    int watch_config;
+    int passthrough;
+    unsigned readahead_kb;
+    unsigned uring_depth;           //< io_uring requests in flight, 0 to make the calls directly
+    const char *index;              //< Verdict index file, if any
+    int build_index;                //< Write the index and exit instead of mounting
+    int prewarm;                    //< Walk the source and fill the caches before mounting
+    unsigned walk_threads;          //< Threads for --build-index and prewarm, 0 for one per core
+    int metrics;                    //< Count the calls, verdicts and cache hits
+    const char *metrics_file;       //< Where to write the metrics out, if anywhere
+    double metrics_interval;        //< Seconds between two writes of metrics_file
+    const char *trace;              //< File to record the calls in, if any
+    int keep_cache;                 //< One of the KEEP_CACHE_* values
+    double entry_timeout;           //< Negative if not set
+    double attr_timeout;            //< Negative if not set
+    double negative_timeout;        //< Negative if not set
+};
+
+// Global to store our configuration (the option parsing results)
+extern struct rofs_config conf;
+
+/** When the kernel may keep the pages it cached for a file across opens */
+enum {
+    KEEP_CACHE_NEVER,
+    KEEP_CACHE_ALWAYS,
+    KEEP_CACHE_MTIME,   //< Unless the source file changed since it was last opened
+};
+
+static const unsigned default_attr_cache_max_entries = 65536;
+static const double default_metrics_interval = 10;
+
+/** The source directory, opened once at start-up. All the file system calls
+ * are made relative to it with the *at() functions, so rofs paths don't need
+ * to be translated (and keep working if the source directory is renamed).
+ * With several source options, the first one. */
+extern int rw_fd;
+
+/** One of the source directories. The mount shows all of them overlaid: a
+ * path is served from the first branch that has it, and directories list the
+ * entries of all the branches they are in. */
+struct source_branch {
+    int fd;
+    std::string path;   //< Absolute, for the calls that have no *at() variant
+};
+
+extern std::vector<source_branch> branches;    //< In the order of the source options
+
+/** Open a source directory and add it after the others.
+ * @return 0, or -errno */
+int add_branch(const char *path);
+
+/** fstatat() "relpath" in the first branch that has it. The mtime of a
+ * directory is the latest one of all the branches it is in, so whatever is
+ * cached about its contents is read again when any of them changes.
+ *
+ * @param branch If not NULL, receives the index of the branch
+ * @return 0, or -1 with errno set */
+int source_stat(const char *relpath, struct stat *st, int flags, unsigned *branch = NULL);
+
+/** Fetch only the file type of "relpath", relative to "dirfd": with statx()
+ * asking for STATX_TYPE and AT_STATX_DONT_SYNC where the kernel has it, so
+ * network file systems can answer from what they have cached instead of
+ * going to the server. The type of a file never changes, so there is nothing
+ * to revalidate. Falls back to fstatat().
+ *
+ * @param mode Receives the S_IFMT bits, the other ones are undefined
+ * @return 0, or -1 with errno set */
+int stat_type(int dirfd, const char *relpath, mode_t *mode, int flags);
+
+/** stat_type() in the first branch that has "relpath", for the filter
+ * decisions and the existence checks that need nothing else.
+ *
+ * @param branch If not NULL, receives the index of the branch
+ * @return 0, or -1 with errno set */
+int source_type(const char *relpath, mode_t *mode, int flags, unsigned *branch = NULL);
+
+/** The descriptor to make the calls on "relpath" relative to: the branch that
+ * has it, or rw_fd if none do. Costs an fstatat() per branch tried, unless
+ * there is only one. */
+int source_fd(const char *relpath);
+
+/** A view option: the source filtered by a config file of its own, shown as a
+ * directory of the mount root. With views, the root has nothing else in it. */
+struct source_view {
+    std::string name;
+    std::string config;     //< Absolute
+};
+
+extern std::vector<source_view> views;     //< In the order of the view options
+
+static const size_t max_views = 64;
+
+/** Which view an rofs path is seen through.
+ *
+ * @param rest If not NULL, receives the path inside the view, the way its
+ * rules see it ("/" for the view itself)
+ * @return The index of the view, or -1 for the root and the names that aren't
+ * views. Always 0 (with "rest" set to "path") without views. */
+int path_view(const char *path, const char **rest = NULL);
+
+/** Translate a source path, the way the rules see it, into a path relative to
+ * rw_fd: "/" is the top of the source, whatever view it is seen through. */
+static inline const char *source_relative_path(const char *path) {
+    while (*path == '/') path++;
+    return *path ? path : ".";
+}
+
+/** Translate an rofs path into a path relative to rw_fd.
+ *
+ * @param path The full path, relative to the rofs mount point. For example, if
+ * the rofs is mounted at /a/path and there's a /a/path/file, the 'ls /a/path'
+ * command will result in calls to this function with the path argument set to
+ * "/" and "/file", which translate to "." and "file". With views, the name of
+ * the view is dropped first, so "/mp3/file" translates to "file" as well. */
+static inline const char *relative_path(const char *path) {
+    if (!views.empty()) {
+        while (*path == '/') path++;
+        while (*path && *path != '/') path++;
+    }
+    return source_relative_path(path);
+}
+
+/** Translate an rofs path into its underlying filesystem path (in the branch
+ * that has it), for the few calls that have no *at() variant. The result is only valid until the next
+ * call from the same thread. */
+const char *translate_path(const char *path);
+
+static inline bool same_mtime(const struct timespec &a, const struct timespec &b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/******************************
+ *
+ * Logging
+ *
+ ******************************/
+
+/** Log a message to syslog and stderr */
+void log_msg(const int level, const char *format, ... /*args*/) __attribute__((format(printf, 2, 3)));
+
+/** Log a debug message. The arguments are only evaluated if debugging is on,
+ * so this can be used on the hot paths. */
+#define log_debug(...) do { \
+    if (__builtin_expect(conf.debug, 0)) log_msg(LOG_DEBUG, __VA_ARGS__); \
+} while (0)
+
+/** With debugging on, log from a background thread so the callbacks don't
+ * wait on syslog and stderr. Must be called after the daemon has forked. */
+void start_log_thread();
+void stop_log_thread();
+
+/******************************
+ *
+ * Metrics
+ *
+ ******************************/
+
+/** The calls that are timed, with the metrics option */
+enum {
+    OP_LOOKUP,
+    OP_GETATTR,
+    OP_READLINK,
+    OP_OPEN,
+    OP_READ,
+    OP_OPENDIR,
+    OP_READDIR,
+    OP_STATFS,
+    OP_ACCESS,
+    OP_GETXATTR,
+    OP_LISTXATTR,
+    OP_COUNT
+};
+
+extern const char *const op_names[OP_COUNT];
+
+/** What else is counted, with the metrics option */
+enum {
+    METRIC_HIDDEN,              //< should_hide() verdicts
+    METRIC_SHOWN,
+    METRIC_RULE_EVALUATIONS,    //< Verdicts the rules had to be run for
+    METRIC_INDEX_VERDICTS,      //< Verdicts taken from the index option's file
+    METRIC_LITERAL_MATCHES,     //< Paths caught by literal_matcher
+    METRIC_REGEX_MATCHES,       //< Paths that took the regex engine to catch
+    METRIC_ATTR_CACHE_HITS,
+    METRIC_ATTR_CACHE_MISSES,
+    METRIC_DIR_INDEX_HITS,
+    METRIC_DIR_INDEX_MISSES,
+    METRIC_DIR_VERDICT_HITS,
+    METRIC_DIR_VERDICT_MISSES,
+    METRIC_READ_BYTES,          //< As asked for, when the data is spliced
+    METRIC_PREFETCHED_BYTES,    //< Asked of the source ahead of the readers (readahead_kb)
+    METRIC_COUNT
+};
+
+typedef thread_metrics<METRIC_COUNT, OP_COUNT> rofs_metrics;
+extern rofs_metrics metrics;
+
+static const char *const metrics_xattr = "user.rofs-filtered.metrics";
+
+/** Queue a finished call for the trace file. Does nothing unless the trace
+ * thread is running.
+ *
+ * @param start, end As given by now_ns() */
+void trace_call(unsigned op, const char *path, uint64_t offset, uint64_t size, uint64_t start, uint64_t end);
+
+static inline void metric_add(unsigned metric, uint64_t n = 1) {
+    if (conf.metrics) metrics.add(metric, n);
+}
+
+static inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** Times a callback into the latency histogram of its call, and records it
+ * in the trace file. "path" must outlive the op_timer. */
+class op_timer {
+public:
+    explicit op_timer(unsigned op, const char *path = NULL, uint64_t offset = 0, uint64_t size = 0)
+        : op(op), path(path), offset(offset), size(size), start(conf.metrics || conf.trace ? now_ns() : 0) {}
+    ~op_timer() { finish(op, start, path, offset, size); }
+
+    /** For a callback that replies later: the reply calls finish() with
+     * started() instead. */
+    uint64_t started() const { return start; }
+    void dismiss() { start = 0; }
+
+    static void finish(unsigned op, uint64_t start, const char *path = NULL, uint64_t offset = 0, uint64_t size = 0) {
+        if (!start) return;
+        uint64_t end = now_ns();
+        if (conf.metrics) metrics.record(op, end - start);
+        if (conf.trace) trace_call(op, path, offset, size, start, end);
+    }
+
+    op_timer(const op_timer&) = delete;
+    void operator = (const op_timer&) = delete;
+
+private:
+    unsigned op;
+    const char *path;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t start;     //< 0 if not timing
+};
+
+/** The metrics in the Prometheus text format, for the metrics_xattr of the
+ * mount root and the metrics_file option. */
+std::string metrics_text();
+
+/** Reply to a getxattr() of the metrics_xattr, as lgetxattr() would */
+int metrics_xattr_value(char *value, size_t size);
+
+/** Write the metrics_file every metrics_interval seconds, and once more when
+ * unmounting. Like the rest of the threads, must be started once the daemon
+ * has forked. */
+void start_metrics_thread();
+void stop_metrics_thread();
+
+/** Write the calls to the trace file from a background thread, so the
+ * callbacks only have to queue them. Must be started once the daemon has
+ * forked. Calls are left out, and counted, when the queue overflows. */
+void start_trace_thread();
+void stop_trace_thread();
@@ -0,0 +1,967 @@
+/* vi:ai:tabstop=8:shiftwidth=4:softtabstop=4:expandtab
+ *
+ * The filter engine of rofs-filtered: reading the rules, and deciding which
+ * source paths they hide. See rofs-filtered.cpp for the license.
+ */
+
+#include "filter.h"
+
+#include <regex.h>
+#include <stdlib.h>
+#include <unistd.h>
+#if __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <fstream>
+#include <sstream>
+#include <string_view>
+
+#if HAVE_RE2
+#include <re2/re2.h>
+#include <re2/set.h>
+#endif
+
+#include "verdict_index.h"
+
+lru_cache<std::string, dir_index_entry> dir_index_cache(dir_index_cache_max_entries);
+
+/** Report user-friendly regex errors */
+static void log_regex_error(int error, regex_t *regex, const char* pattern) {
+    size_t msg_len;
+    char *err_msg;
+
+    msg_len = regerror(error, regex, NULL, 0);
+    err_msg = (char *)malloc(msg_len);
+
+    if (err_msg) {
+        regerror(error, regex, err_msg, msg_len);
+        log_msg(LOG_ERR, "RegEx error: \"%s\" while parsing pattern: \"%s\"",
+                err_msg, pattern);
+        //printf("Error: %s %s\n", err_msg, pattern);
+        free(err_msg);
+    }
+
+    regfree(regex);
+}
+
+static std::vector<std::string> split(const std::string &s, char delim) {
+    std::vector<std::string> result;
+    std::stringstream ss (s);
+    std::string item;
+
+    while (getline (ss, item, delim)) {
+        result.push_back (item);
+    }
+
+    return result;
+}
+
+/** Evaluates all the patterns as a single (a)|(b)|(c) regex with regexec() */
+class posix_matcher : public pattern_matcher {
+public:
+    posix_matcher() : compiled(false) {}
+
+    ~posix_matcher() {
+        if (compiled) regfree(&pattern);
+    }
+
+    bool compile(const std::vector<std::string> &patterns) {
+        std::stringstream full_pattern;   //< Buffer to store the merged patterns
+        for (const auto &p : patterns) {
+            if (full_pattern.rdbuf()->in_avail()) {
+                full_pattern << "|(" << p << ")";
+            } else {
+                full_pattern << "(" << p << ")";
+            }
+        }
+
+        std::string pattern_str = full_pattern.str();
+        log_debug("Full regex: %s", pattern_str.c_str());
+
+        int regcomp_res = regcomp(&pattern, pattern_str.c_str(), REG_EXTENDED | REG_NOSUB);
+        if (regcomp_res) {
+            log_regex_error(regcomp_res, &pattern, pattern_str.c_str());
+            return false;
+        }
+        compiled = true;
+        return true;
+    }
+
+    const char *engine() const { return "posix"; }
+
+    bool match(const char *path) const {
+        return !regexec(&pattern, path, 0, NULL, 0);
+    }
+
+private:
+    regex_t pattern;
+    bool compiled;
+};
+
+#if HAVE_RE2
+/** Whether a POSIX ERE has a backslash in a bracket expression, where POSIX
+ * takes it for itself ("[\.]" matches a backslash or a dot) but RE2 takes it
+ * for an escape. */
+static bool backslash_in_brackets(const std::string &p) {
+    for (size_t i = 0; i < p.size(); i++) {
+        if (p[i] == '\\') {
+            i++;
+            continue;
+        }
+        if (p[i] != '[') continue;
+
+        // A ']' right after the '[' or the '^' is one of the characters
+        size_t j = i + 1;
+        if (j < p.size() && p[j] == '^') j++;
+        if (j < p.size() && p[j] == ']') j++;
+        for (; j < p.size() && p[j] != ']'; j++) {
+            if (p[j] == '\\') return true;
+            if (p[j] == '[' && j + 1 < p.size() && (p[j + 1] == ':' || p[j + 1] == '.' || p[j + 1] == '=')) {
+                // [:alpha:], [.x.] and [=x=] end with their own ":]", ".]" or "=]"
+                const char end[] = { p[j + 1], ']', 0 };
+                j = p.find(end, j + 2);
+                if (j == std::string::npos) return false;
+                j++;
+            }
+        }
+        i = j;
+    }
+    return false;
+}
+
+/** Evaluates all the patterns in a single pass with an RE2::Set (a DFA).
+ * Falls back on the POSIX engine if the DFA runs out of memory, and leaves it
+ * the patterns RE2 would read differently. */
+class re2_matcher : public pattern_matcher {
+public:
+    re2_matcher() : set(options(), RE2::UNANCHORED), set_size(0), posix_size(0) {}
+
+    bool compile(const std::vector<std::string> &patterns) {
+        std::vector<std::string> posix_patterns;
+        for (const auto &p : patterns) {
+            if (backslash_in_brackets(p)) {
+                log_debug("Leaving pattern to the posix engine: %s", p.c_str());
+                posix_patterns.push_back(p);
+                continue;
+            }
+            std::string error;
+            if (set.Add(p, &error) < 0) {
+                log_msg(LOG_INFO, "RE2 can not handle pattern: \"%s\" (%s)", p.c_str(), error.c_str());
+                return false;
+            }
+            set_size++;
+        }
+        if (set_size && !set.Compile()) {
+            log_msg(LOG_INFO, "RE2 ran out of memory compiling the patterns");
+            return false;
+        }
+        posix_size = posix_patterns.size();
+        if (posix_size && !posix_only.compile(posix_patterns)) return false;
+        return fallback.compile(patterns);
+    }
+
+    const char *engine() const { return "re2"; }
+
+    bool match(const char *path) const {
+        if (posix_size && posix_only.match(path)) return true;
+        if (!set_size) return false;
+
+        RE2::Set::ErrorInfo error;
+        if (set.Match(path, NULL, &error)) return true;
+        if (error.kind == RE2::Set::kNoError) return false;
+        return fallback.match(path);
+    }
+
+private:
+    /** Make RE2 follow the POSIX ERE semantics regexec() uses */
+    static RE2::Options options() {
+        RE2::Options opts;
+        opts.set_posix_syntax(true);
+        opts.set_encoding(RE2::Options::EncodingLatin1);   // Bytes, as regexec() in the C locale
+        opts.set_longest_match(true);
+        opts.set_perl_classes(true);    // \s \w etc. are glibc extensions
+        opts.set_word_boundary(true);
+        opts.set_one_line(true);        // ^ and $ don't match at newlines
+        opts.set_dot_nl(true);
+        opts.set_never_capture(true);
+        opts.set_log_errors(false);
+        opts.set_max_mem(64 << 20);
+        return opts;
+    }
+
+    RE2::Set set;
+    size_t set_size;            //< Patterns in set
+    posix_matcher posix_only;   //< The patterns backslash_in_brackets() kept out of set
+    size_t posix_size;
+    posix_matcher fallback;     //< All the patterns
+};
+#endif
+
+/** Build a matcher for the given patterns using the engine selected with the
+ * regex_engine option, or the fastest one available. */
+static std::unique_ptr<pattern_matcher> make_matcher(const std::vector<std::string> &patterns) {
+    std::string engine = conf.regex_engine ? conf.regex_engine : "";
+
+#if HAVE_RE2
+    if (engine.empty() || engine == "re2") {
+        std::unique_ptr<re2_matcher> m(new re2_matcher());
+        if (m->compile(patterns)) return std::move(m);
+        log_msg(LOG_INFO, "Falling back on the posix regex engine");
+    }
+#else
+    if (engine == "re2") {
+        log_msg(LOG_ERR, "%s was built without RE2 support, using the posix regex engine", PACKAGE_STRING);
+    }
+#endif
+
+    std::unique_ptr<posix_matcher> m(new posix_matcher());
+    if (m->compile(patterns)) return std::move(m);
+    return NULL;
+}
+
+static std::atomic<uint64_t> filter_generation;  //< Last generation handed out by read_config()
+
+std::mutex filters_lock;
+std::shared_ptr<const filter_set> filters;
+std::atomic<uint64_t> filters_published;
+
+void publish_filters(std::shared_ptr<const filter_set> fs) {
+    std::lock_guard<std::mutex> guard(filters_lock);
+    uint64_t generation = fs->generation;
+    filters = std::move(fs);
+    filters_published.store(generation, std::memory_order_release);
+}
+
+/** Compile the rules read into fs.program */
+static void compile_rules(filter_set &fs) {
+    rule_program &program = fs.program;
+    program.count = 0;
+
+    // extensionPriority only applies without invert, before anything else
+    if (!conf.invert && !fs.extPriority.empty()) program.steps[program.count++] = STEP_PRIORITY;
+
+    // The type: lines hide their file types, unless inverted. Inverted, all
+    // the types but files and directories are hidden as well.
+    program.typed = fs.modes;
+    if (conf.invert) program.typed |= ~(type_bit(S_IFREG) | type_bit(S_IFDIR)) & 0xffff;
+    program.typed_hidden = conf.invert ? program.typed & ~fs.modes : fs.modes;
+    if (program.typed) program.steps[program.count++] = STEP_TYPE;
+
+    if (fs.literals) program.steps[program.count++] = STEP_LITERALS;
+    if (fs.matcher) program.steps[program.count++] = STEP_PATTERNS;
+    program.matched = !conf.invert;
+    program.otherwise = conf.invert;
+}
+
+int read_config(const std::filesystem::path &conf_file, filter_set &fs) {
+    int regcomp_res;
+    std::vector<std::string> patterns;
+    std::vector<std::string> direct_io_patterns, keep_cache_patterns;
+
+    // File types we want to ignore
+    regex_t type_pattern;
+    regcomp_res = regcomp(&type_pattern, "^\\|\\s*type:\\s*(CHR|BLK|FIFO|LNK|SOCK)\\s*$", REG_EXTENDED);
+    if (regcomp_res) {
+        log_msg(LOG_ERR, "Failed compiling config parser regex.");
+        return -3;
+    }
+    scope_guard free_type_pattern = [&](){ regfree(&type_pattern); };
+
+    // Config file lines we want to ignore
+    regex_t ignore_pattern;
+    regcomp_res = regcomp(&ignore_pattern, "^#|^\\s*$",
+                    REG_EXTENDED | REG_NOSUB);
+    if (regcomp_res) {
+        log_msg(LOG_ERR, "Failed compiling config parser regex.");
+        regfree(&type_pattern);
+        return -3;
+    }
+    scope_guard free_ignore_pattern = [&](){ regfree(&ignore_pattern); };
+
+    std::ifstream input(conf_file);
+    if (input.fail()) {
+        log_msg(LOG_ERR, "Failed to open config file: %s", conf_file.c_str());
+        return -1;
+    }
+    scope_guard close_file = [&](){ input.close(); };
+
+    std::string line;
+    std::string rules = conf.invert ? "invert\n" : "\n";
+    while (std::getline(input, line)) {
+        // Ignore comments or empty lines in the config file
+        if (line.empty()) continue;
+        if (! regexec(&ignore_pattern, line.c_str(), 0, NULL, 0)) continue;
+
+        if (line[line.size() - 1] == '\n') {
+            line = line.substr(0, line.size() - 1);
+        }
+        rules += line;
+        rules += '\n';
+
+        regmatch_t match[2];
+        if (! regexec(&type_pattern, line.c_str(), sizeof(match) / sizeof(*match), match, 0)) {
+            log_debug("Type: %s", line.c_str() + 5);
+            if (strncmp(line.c_str() + match[1].rm_so, "CHR", 3) == 0) {
+                fs.modes |= type_bit(S_IFCHR);
+            } else if (strncmp(line.c_str() + match[1].rm_so, "BLK", 3) == 0) {
+                fs.modes |= type_bit(S_IFBLK);
+            } else if (strncmp(line.c_str() + match[1].rm_so, "LNK", 3) == 0) {
+                fs.modes |= type_bit(S_IFLNK);
+            } else if (strncmp(line.c_str() + match[1].rm_so, "FIFO", 4) == 0) {
+                fs.modes |= type_bit(S_IFIFO);
+            } else if (strncmp(line.c_str() + match[1].rm_so, "SOCK", 4) == 0) {
+                fs.modes |= type_bit(S_IFSOCK);
+            }
+            continue;
+        }
+
+        static const std::string prefix("|extensionPriority:");
+        if (line.find(prefix) == 0) {
+            auto extensions = split(line.substr(prefix.size()), ',');
+            if (extensions.empty()) continue;
+
+            static const std::string dot(".");
+            for (auto it = extensions.crbegin(); it != extensions.crend(); ++it) {
+                for (auto it2 = it + 1; it2 != extensions.crend(); ++it2) {
+                    log_debug("%s overrides %s", it2->c_str(), it->c_str());
+                    fs.extPriority.emplace(std::make_pair(dot + *it, dot + *it2));
+                    fs.extPriorityWinners.emplace(dot + *it2);
+                }
+            }
+            continue;
+        }
+
+        // Page cache policy for the files matching a RegEx
+        static const std::string direct_io_prefix("|io:direct_io:");
+        static const std::string keep_cache_prefix("|io:keep_cache:");
+        bool direct_io = line.find(direct_io_prefix) == 0;
+        if (direct_io || line.find(keep_cache_prefix) == 0) {
+            std::string io_pattern = line.substr(direct_io ? direct_io_prefix.size() : keep_cache_prefix.size());
+            regex_t pattern;
+            regcomp_res = regcomp(&pattern, io_pattern.c_str(), REG_EXTENDED | REG_NOSUB);
+            if (regcomp_res) {
+                log_regex_error(regcomp_res, &pattern, io_pattern.c_str());
+            } else {
+                regfree(&pattern);
+                log_debug("%s pattern: %s", direct_io ? "direct_io" : "keep_cache", io_pattern.c_str());
+                (direct_io ? direct_io_patterns : keep_cache_patterns).push_back(io_pattern);
+            }
+            continue;
+        }
+
+        // Test if standalone regex compiles before concatenating.
+        regex_t pattern;
+        regcomp_res = regcomp(&pattern, line.c_str(), REG_EXTENDED | REG_NOSUB);
+        if (regcomp_res) {
+            // This one failed, we verbosely ignore it.
+            log_regex_error(regcomp_res, &pattern, line.c_str());
+        } else {
+            regfree(&pattern);
+            log_debug("Pattern: %s", line.c_str());
+            patterns.push_back(line);
+        }
+    }
+
+    if (patterns.empty() && fs.extPriority.empty() && !fs.modes
+            && direct_io_patterns.empty() && keep_cache_patterns.empty()) {
+        log_msg(LOG_ERR, "Config file contains no valid pattern.");
+        return -1;
+    }
+
+    // Take the plain literals out of the regex engine's hands
+    std::unique_ptr<literal_matcher> lits(new literal_matcher());
+    std::vector<std::string> regex_patterns;
+    for (const auto &p : patterns) {
+        if (lits->add(p)) {
+            log_debug("Literal pattern: %s", p.c_str());
+        } else {
+            regex_patterns.push_back(p);
+        }
+    }
+    if (!lits->empty()) {
+        log_msg(LOG_INFO, "%s: Matching %zu patterns as plain literals",
+                PACKAGE_STRING, patterns.size() - regex_patterns.size());
+        fs.literals = std::move(lits);
+    }
+
+    if (!regex_patterns.empty()) {
+        fs.matcher = make_matcher(regex_patterns);
+        if (!fs.matcher) return -1;
+
+        log_msg(LOG_INFO, "%s: Using the %s regex engine for %zu patterns",
+                PACKAGE_STRING, fs.matcher->engine(), regex_patterns.size());
+    }
+
+    if (!direct_io_patterns.empty()) {
+        fs.direct_io = make_matcher(direct_io_patterns);
+        if (!fs.direct_io) return -1;
+    }
+    if (!keep_cache_patterns.empty()) {
+        fs.keep_cache = make_matcher(keep_cache_patterns);
+        if (!fs.keep_cache) return -1;
+    }
+
+    compile_rules(fs);
+    fs.fingerprint = verdict_hash(rules.data(), rules.size());
+    fs.generation = ++filter_generation;
+    return 0;
+}
+
+int read_filters(filter_set &fs, std::string &failed) {
+    if (views.empty()) {
+        failed = conf.config;
+        return read_config(conf.config, fs);
+    }
+
+    std::string fingerprints;
+    for (const auto &view : views) {
+        std::unique_ptr<filter_set> view_fs(new filter_set());
+        int res = read_config(view.config, *view_fs);
+        if (res) {
+            failed = view.config;
+            return res;
+        }
+        fs.extPriority.insert(view_fs->extPriority.begin(), view_fs->extPriority.end());
+        fs.extPriorityWinners.insert(view_fs->extPriorityWinners.begin(), view_fs->extPriorityWinners.end());
+        fingerprints += view.name;
+        fingerprints.append((const char *)&view_fs->fingerprint, sizeof(view_fs->fingerprint));
+        fs.views.push_back(std::move(view_fs));
+    }
+
+    fs.fingerprint = verdict_hash(fingerprints.data(), fingerprints.size());
+    fs.generation = ++filter_generation;
+    for (auto &view_fs : fs.views) {
+        view_fs->generation = fs.generation;
+        // The directory indexes are shared, so they must have the names all
+        // the views look for
+        view_fs->extPriorityWinners = fs.extPriorityWinners;
+    }
+    return 0;
+}
+
+const filter_set *view_filters(const filter_set &fs, const char *&path) {
+    if (fs.views.empty()) return &fs;
+
+    int view = path_view(path, &path);
+    return view < 0 ? NULL : fs.views[view].get();
+}
+
+/** Return the extension of a file name, including the leading dot, or NULL if
+ * it has none. Follows the same rules as std::filesystem::path::extension(). */
+static const char *file_extension(const char *fname) {
+    const char *dot = strrchr(fname, '.');
+    if (dot == NULL || dot == fname) return NULL;
+    if (strcmp(fname, "..") == 0) return NULL;
+    return dot;
+}
+
+std::shared_ptr<dir_index> new_dir_index(const struct stat &dir_st) {
+    auto index = std::make_shared<dir_index>();
+    index->mtime = dir_st.st_mtim;
+    return index;
+}
+
+void cache_dir_index(const filter_set &fs, const std::string &dir, std::shared_ptr<const dir_index> index) {
+    dir_index_entry entry;
+    entry.expires = std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(conf.attr_cache_ttl));
+    entry.generation = fs.generation;
+    entry.index = std::move(index);
+    dir_index_cache.put(dir, entry);
+}
+
+void dir_index_add(const filter_set &fs, dir_index &index, const char *name, unsigned char type) {
+    const char *ext = file_extension(name);
+    if (ext && fs.extPriorityWinners.count(ext)) {
+        index.names.emplace(name, type);
+    }
+}
+
+#if __linux__
+/** What getdents64() fills its buffer with */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];     //< As long as d_reclen makes it
+};
+#endif
+
+static const size_t getdents_buffer_size = 64 * 1024;
+
+int source_dir::open(const char *relpath, bool list) {
+    close_all();
+    names.clear();
+    name_at.clear();
+    inos.clear();
+    types.clear();
+    entry_branches.clear();
+    dir_fds.assign(branches.size(), -1);
+
+    int err = ENOENT;
+    bool found = false;
+    for (size_t b = 0; b < branches.size(); b++) {
+        int fd = openat(branches[b].fd, relpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        struct stat branch_st;
+        if (fd == -1 || fstat(fd, &branch_st)) {
+            if (b == 0) err = errno;
+            if (fd != -1) close(fd);
+            continue;
+        }
+        dir_fds[b] = fd;
+
+        if (!found) {
+            st = branch_st;
+            found = true;
+        } else if (branch_st.st_mtim.tv_sec > st.st_mtim.tv_sec || (branch_st.st_mtim.tv_sec == st.st_mtim.tv_sec
+                && branch_st.st_mtim.tv_nsec > st.st_mtim.tv_nsec)) {
+            st.st_mtim = branch_st.st_mtim;
+        }
+        if (!list) continue;
+
+        // Reading moves the position of fd, which fds() users don't mind
+        int res = read_entries(fd, b);
+        if (res) return res;
+    }
+    if (branches.size() > 1) drop_duplicates();
+    return found ? 0 : -err;
+}
+
+int source_dir::read_entries(int fd, unsigned branch) {
+#if __linux__
+    // Only used within a call, so nested source_dirs can share it
+    static thread_local std::unique_ptr<char[]> buf(new char[getdents_buffer_size]);
+    for (;;) {
+        long len = syscall(SYS_getdents64, fd, buf.get(), getdents_buffer_size);
+        if (len == -1) return -errno;
+        if (len == 0) return 0;
+
+        for (long at = 0; at < len; ) {
+            const linux_dirent64 *de = (const linux_dirent64 *)(buf.get() + at);
+            const char *name = buf.get() + at + offsetof(linux_dirent64, d_name);
+            add(name, strlen(name), de->d_ino, de->d_type, branch);
+            at += de->d_reclen;
+        }
+    }
+#else
+    int dup_fd = dup(fd);
+    DIR *dp = dup_fd == -1 ? NULL : fdopendir(dup_fd);
+    if (dp == NULL) {
+        int res = -errno;
+        if (dup_fd != -1) close(dup_fd);
+        return res;
+    }
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) add(de->d_name, strlen(de->d_name), de->d_ino, de->d_type, branch);
+    closedir(dp);
+    return 0;
+#endif
+}
+
+void source_dir::add(const char *name, size_t len, ino_t ino, unsigned char type, unsigned branch) {
+    name_at.push_back(names.size());
+    names.insert(names.end(), name, name + len + 1);
+    inos.push_back(ino);
+    types.push_back(type);
+    entry_branches.push_back(branch);
+}
+
+void source_dir::drop_duplicates() {
+    // The names don't move any more, so they can be looked up in place
+    static thread_local std::unordered_set<std::string_view> seen;
+    seen.clear();
+    size_t kept = 0;
+    for (size_t i = 0; i < size(); i++) {
+        if (!seen.insert(name(i)).second) continue;
+        name_at[kept] = name_at[i];
+        inos[kept] = inos[i];
+        types[kept] = types[i];
+        entry_branches[kept] = entry_branches[i];
+        kept++;
+    }
+    name_at.resize(kept);
+    inos.resize(kept);
+    types.resize(kept);
+    entry_branches.resize(kept);
+}
+
+void source_dir::resolve_types(const char *path) {
+    mode_t mode;
+    for (size_t i = 0; i < size(); i++) {
+        if (types[i] != DT_UNKNOWN) continue;
+        if (stat_type(dir_fds[entry_branches[i]], name(i), &mode, AT_SYMLINK_NOFOLLOW) == 0) {
+            types[i] = IFTODT(mode);
+        } else {
+            log_msg(LOG_ERR, "%s: unexpected statx()/fstatat() error for %s%s%s: %s", PACKAGE_STRING, path,
+                    strcmp(path, "/") ? "/" : "", name(i), strerror(errno));
+        }
+    }
+}
+
+void source_dir::close_all() {
+    for (int fd : dir_fds) {
+        if (fd != -1) close(fd);
+    }
+    dir_fds.clear();
+}
+
+/** Get the index of a source directory, (re)reading it if it changed since it
+ * was last indexed. The directory mtime is checked at most once per
+ * attr_cache_ttl.
+ *
+ * @param dir The source path of the directory, as the rules see it.
+ * @return NULL if the directory could not be read. */
+static std::shared_ptr<const dir_index> get_dir_index(const filter_set &fs, const std::string &dir) {
+    dir_index_entry cached;
+    if (dir_index_cache.get(dir, cached) && cached.generation != fs.generation) {
+        cached.index.reset();
+    } else if (cached.index && std::chrono::steady_clock::now() < cached.expires) {
+        metric_add(METRIC_DIR_INDEX_HITS);
+        return cached.index;
+    }
+
+    struct stat st;
+    if (source_stat(source_relative_path(dir.c_str()), &st, AT_SYMLINK_NOFOLLOW)) return NULL;
+    if (cached.index && same_mtime(cached.index->mtime, st.st_mtim)) {
+        metric_add(METRIC_DIR_INDEX_HITS);
+        cache_dir_index(fs, dir, cached.index);
+        return cached.index;
+    }
+    metric_add(METRIC_DIR_INDEX_MISSES);
+
+    source_dir source;
+    if (source.open(source_relative_path(dir.c_str()))) return NULL;
+
+    auto new_index = new_dir_index(source.stat());
+    for (size_t i = 0; i < source.size(); i++) {
+        dir_index_add(fs, *new_index, source.name(i), source.type(i));
+    }
+
+    cache_dir_index(fs, dir, new_index);
+    return new_index;
+}
+
+/** Check if a file with the same stem but a higher priority extension exists.
+ *
+ * @param index The index of the directory containing "name", or NULL to look
+ * it up in the cache. */
+static bool has_priority_sibling(const filter_set &fs, const char *name, const dir_index *index) {
+    const char *fname = strrchr(name, '/');
+    fname = fname ? fname + 1 : name;
+
+    const char *ext = file_extension(fname);
+    if (ext == NULL) return false;
+
+    auto range = fs.extPriority.equal_range(ext);
+    if (range.first == range.second) return false;
+
+    std::shared_ptr<const dir_index> cached;
+    if (index == NULL) {
+        static thread_local std::string dir;
+        dir.assign(name, fname - name);
+        if (dir.size() > 1) dir.pop_back();   // Drop the trailing '/'
+        cached = get_dir_index(fs, dir);
+        index = cached.get();
+    }
+
+    // The sibling's name, and its path relative to the source
+    static thread_local std::string sibling, sibling_path;
+    sibling.assign(fname, ext - fname);
+    const size_t stem_len = sibling.size();
+    for (auto it = range.first; it != range.second; ++it) {
+        sibling.resize(stem_len);
+        sibling += it->second;
+
+        if (index) {
+            auto found = index->names.find(sibling);
+            if (found == index->names.end()) continue;
+            if (found->second != DT_LNK && found->second != DT_UNKNOWN) return true;
+        }
+
+        // Follow symbolic links (or look for the file if we have no index) to
+        // check that the higher priority file really exists.
+        sibling_path.assign(name, fname - name);
+        sibling_path += sibling;
+        mode_t mode;
+        if (source_type(source_relative_path(sibling_path.c_str()), &mode, 0) == 0) return true;
+    }
+    return false;
+}
+
+int evaluate_rules(const filter_set &fs, const char *name, mode_t mode, const dir_index *index) {
+    if (!fs.views.empty()) {
+        const char *view_name = name;
+        const filter_set *view_fs = view_filters(fs, view_name);
+        if (view_fs == NULL) return strcmp(name, "/") != 0;
+        if (strcmp(view_name, "/") == 0) return false;
+        return evaluate_rules(*view_fs, view_name, mode, index);
+    }
+
+    mode &= S_IFMT;
+    log_debug("should_hide test: %07o %s", mode, name);
+    metric_add(METRIC_RULE_EVALUATIONS);
+
+    const rule_program &program = fs.program;
+    for (unsigned i = 0; i < program.count; i++) {
+        switch (program.steps[i]) {
+        case STEP_PRIORITY:
+            if (has_priority_sibling(fs, name, index)) return true;
+            break;
+        case STEP_TYPE:
+            if (program.typed & type_bit(mode)) {
+                log_debug("type: %07o %s", mode, name);
+                return (program.typed_hidden & type_bit(mode)) != 0;
+            }
+            break;
+        case STEP_LITERALS:
+            if (fs.literals->match(name)) {
+                log_debug("match: %s", name);
+                metric_add(METRIC_LITERAL_MATCHES);
+                return program.matched;
+            }
+            break;
+        case STEP_PATTERNS:
+            if (fs.matcher->match(name)) {
+                log_debug("match: %s", name);
+                metric_add(METRIC_REGEX_MATCHES);
+                return program.matched;
+            }
+            break;
+        }
+    }
+    return program.otherwise;
+}
+
+/** The verdict index built with --build-index, once it's been loaded */
+struct loaded_index {
+    verdict_index file;
+    /** Per directory: when to compare its mtime again (steady_clock ticks),
+     * or index_dir_stale once it changed since the index was built. */
+    std::unique_ptr<std::atomic<int64_t>[]> check_at;
+};
+
+static const int64_t index_dir_stale = -1;
+static std::atomic<const loaded_index *> verdict_file;  //< Never freed once published
+
+/** Whether the directory of "name" is as it was when the index was built.
+ * Checked at most once per attr_cache_ttl, as get_dir_index() does. */
+static bool index_dir_valid(const loaded_index &index, uint32_t dir, const char *name) {
+    const int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+    const int64_t check_at = index.check_at[dir].load(std::memory_order_relaxed);
+    if (check_at == index_dir_stale) return false;
+    if (check_at && now < check_at) return true;
+
+    const char *slash = strrchr(name, '/');
+    std::string parent(name, slash && slash != name ? slash - name : 1);
+    struct stat st;
+    bool same = source_stat(relative_path(parent.c_str()), &st, AT_SYMLINK_NOFOLLOW) == 0
+        && same_mtime(st.st_mtim, index.file.dir_mtime(dir));
+
+    index.check_at[dir].store(!same ? index_dir_stale : now +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(conf.attr_cache_ttl)).count(),
+            std::memory_order_relaxed);
+    return same;
+}
+
+/** The verdict for a path on its own, from the index if it has one */
+static int own_verdict(const filter_set &fs, const char *name, mode_t mode, const dir_index *index) {
+    const loaded_index *file = verdict_file.load(std::memory_order_acquire);
+    if (file && file->file.fingerprint() == fs.fingerprint) {
+        verdict_index::entry e;
+        if (file->file.find(verdict_hash(name, strlen(name)), e) && e.mode == (mode & S_IFMT)
+                && index_dir_valid(*file, e.dir, name)) {
+            metric_add(METRIC_INDEX_VERDICTS);
+            return e.hide;
+        }
+    }
+
+    return evaluate_rules(fs, name, mode, index);
+}
+
+/** Whether a directory, or any directory above it, is hidden */
+struct dir_verdict {
+    std::chrono::steady_clock::time_point expires;  //< Only with extensionPriority
+    uint64_t generation;    //< The filter_set the verdict was computed with
+    bool hidden;
+};
+
+static lru_cache<std::string, dir_verdict> dir_verdicts(default_attr_cache_max_entries);
+
+static const size_t local_dir_verdicts_max = 4096;
+
+/** The verdicts this thread used last, in front of "dir_verdicts" so the
+ * common lookups take no lock. Emptied when the rules change, or it's full. */
+struct local_dir_verdicts {
+    uint64_t generation = 0;
+    std::unordered_map<std::string, dir_verdict> verdicts;
+
+    std::unordered_map<std::string, dir_verdict> &of(const filter_set &fs) {
+        if (generation != fs.generation || verdicts.size() >= local_dir_verdicts_max) {
+            verdicts.clear();
+            generation = fs.generation;
+        }
+        return verdicts;
+    }
+};
+
+static thread_local local_dir_verdicts local_verdicts;
+
+static bool dir_verdict_valid(const filter_set &fs, const dir_verdict &cached) {
+    return cached.generation == fs.generation
+        && (fs.extPriority.empty() || std::chrono::steady_clock::now() < cached.expires);
+}
+
+/** A cached dir_verdict for "dir", if it's still good. A directory can only
+ * change verdicts without a reload through extensionPriority, so that's the
+ * only case in which they expire (after attr_cache_ttl, like get_dir_index()). */
+static bool cached_dir_verdict(const filter_set &fs, const std::string &dir, bool &hidden) {
+    auto &local = local_verdicts.of(fs);
+    auto it = local.find(dir);
+    if (it != local.end() && dir_verdict_valid(fs, it->second)) {
+        metric_add(METRIC_DIR_VERDICT_HITS);
+        hidden = it->second.hidden;
+        return true;
+    }
+
+    // Another thread may have cached it (or prewarm)
+    dir_verdict cached;
+    if (!dir_verdicts.get(dir, cached) || !dir_verdict_valid(fs, cached)) {
+        metric_add(METRIC_DIR_VERDICT_MISSES);
+        return false;
+    }
+    metric_add(METRIC_DIR_VERDICT_HITS);
+    local[dir] = cached;
+    hidden = cached.hidden;
+    return true;
+}
+
+void cache_dir_verdict(const filter_set &fs, const std::string &dir, bool hidden) {
+    dir_verdict verdict;
+    verdict.expires = std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(conf.attr_cache_ttl));
+    verdict.generation = fs.generation;
+    verdict.hidden = hidden;
+    local_verdicts.of(fs)[dir] = verdict;
+    dir_verdicts.put(dir, verdict);
+}
+
+/** Whether one of the directories above "name" is hidden. Their verdicts are
+ * cached, so once the parent has been seen this takes a single lookup instead
+ * of running the rules on every ancestor. */
+static bool ancestor_hidden(const filter_set &fs, const char *name) {
+    const char *slash = strrchr(name, '/');
+    if (slash == NULL || slash == name) return false;  // The root is never hidden
+
+    static thread_local std::string parent;
+    bool hidden;
+    if (cached_dir_verdict(fs, parent.assign(name, slash - name), hidden)) return hidden;
+
+    // "parent" is reused further up, so work on a copy
+    std::string dir(parent);
+    hidden = ancestor_hidden(fs, dir.c_str()) || own_verdict(fs, dir.c_str(), S_IFDIR, NULL);
+    cache_dir_verdict(fs, dir, hidden);
+    return hidden;
+}
+
+int should_hide(const filter_set &fs, const char *name, mode_t mode, const dir_index *index) {
+    mode &= S_IFMT;
+    auto verdict = [](bool hidden) {
+        metric_add(hidden ? METRIC_HIDDEN : METRIC_SHOWN);
+        return hidden;
+    };
+
+    static thread_local std::string key;
+    bool hidden;
+    if (mode == S_IFDIR && cached_dir_verdict(fs, key.assign(name), hidden)) return verdict(hidden);
+
+    if (ancestor_hidden(fs, name)) return verdict(true);
+
+    hidden = own_verdict(fs, name, mode, index);
+    if (mode == S_IFDIR && strcmp(name, "/") != 0) cache_dir_verdict(fs, name, hidden);
+    return verdict(hidden);
+}
+
+int should_hide(const char *name, mode_t mode) {
+    filter_ref fs;
+    return should_hide(*fs, name, mode);
+}
+
+unsigned walk_threads() {
+    if (conf.walk_threads) return conf.walk_threads;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+int build_index(const filter_set &fs, const std::string &file, const std::atomic<bool> &stop) {
+    verdict_index_writer writer;
+    std::mutex writer_lock;
+    bool too_many_dirs = false;
+
+    bool done = walk_tree(fs, false, stop, [&](const walked_dir &dir) {
+        std::lock_guard<std::mutex> guard(writer_lock);
+        int64_t dir_id = writer.add_dir(dir.st.st_mtim);
+        if (dir_id < 0) {
+            too_many_dirs = true;
+            return;
+        }
+        for (const auto &e : dir.entries) {
+            writer.add(verdict_hash(e.path.data(), e.path.size()), dir_id, e.mode, e.hide);
+        }
+    });
+    if (!done) return -EINTR;
+    if (too_many_dirs) return -EFBIG;
+
+    log_msg(LOG_INFO, "%s: Indexed %zu paths", PACKAGE_STRING, writer.size());
+    return writer.write(file, fs.fingerprint);
+}
+
+int load_index(const filter_set &fs, const std::string &file) {
+    std::unique_ptr<loaded_index> index(new loaded_index());
+    int res = index->file.open(file);
+    if (res) return res;
+    if (index->file.fingerprint() != fs.fingerprint) return -ESTALE;
+
+    index->check_at.reset(new std::atomic<int64_t>[index->file.dir_count()]());
+    verdict_file.store(index.release(), std::memory_order_release);
+    return 0;
+}
+
+static std::thread index_thread;
+static std::atomic<bool> index_thread_quit;
+
+void start_index_thread() {
+    if (conf.index == NULL || conf.build_index) return;
+
+    // A build for the rules that were replaced is of no use any more
+    stop_index_thread();
+    filter_ref current;
+    const loaded_index *file = verdict_file.load(std::memory_order_acquire);
+    if (file && file->file.fingerprint() == current->fingerprint) return;
+    // It may have been built for them already, by --build-index or before
+    // going back to earlier rules
+    if (load_index(*current, conf.index) == 0) return;
+
+    index_thread_quit.store(false, std::memory_order_relaxed);
+    index_thread = std::thread([]() {
+        filter_ref fs;
+        int res = build_index(*fs, conf.index, index_thread_quit);
+        if (res == 0) res = load_index(*fs, conf.index);
+        if (res == 0) {
+            log_msg(LOG_INFO, "%s: Serving verdicts from %s", PACKAGE_STRING, conf.index);
+        } else if (res != -EINTR) {
+            log_msg(LOG_ERR, "%s: Can not build the index %s: %s", PACKAGE_STRING, conf.index, strerror(-res));
+        }
+    });
+}
+
+void stop_index_thread() {
+    if (!index_thread.joinable()) return;
+
+    index_thread_quit.store(true, std::memory_order_relaxed);
+    index_thread.join();
+}
+
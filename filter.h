@@ -0,0 +1,389 @@
+#pragma once
+
+/**
+The filter engine: the rules of the config file and the verdicts they give on
+source paths. It doesn't depend on FUSE, so it is built as a library for
+rofs-filtered and the benchmarks to link against.
+*/
+
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "literal_matcher.h"
+#include "lru_cache.h"
+#include "scope_guard.h"
+#include "work_stealing.h"
+
+/** Matches a path against all the RegEx patterns from the config file. The
+ * patterns follow the POSIX extended regex syntax, no matter which engine is
+ * used to evaluate them. */
+class pattern_matcher {
+public:
+    virtual ~pattern_matcher() {}
+
+    /** A short name of the regex engine, for logging */
+    virtual const char *engine() const = 0;
+
+    /** Check if the path matches at least one of the patterns */
+    virtual bool match(const char *path) const = 0;
+};
+
+/** One bit per file type, for the masks of file types */
+static inline unsigned type_bit(mode_t mode) {
+    return 1u << ((mode & S_IFMT) >> 12);
+}
+
+/** A check evaluate_rules() makes */
+enum rule_step : uint8_t {
+    STEP_PRIORITY,  //< Hidden if a sibling wins on extensionPriority
+    STEP_TYPE,      //< Decided by the file type alone
+    STEP_LITERALS,  //< Decided if literal_matcher catches the path
+    STEP_PATTERNS,  //< Decided if the regex engine does
+};
+
+/** The rules of a filter_set compiled by read_config() into the checks that
+ * can decide a path, in the order they are made. Whatever is known once the
+ * config file is read (the invert option, which kinds of rules it has) is
+ * folded in, so evaluate_rules() only goes through the steps. */
+struct rule_program {
+    rule_step steps[4];
+    uint8_t count;
+    uint16_t typed;         //< The file types STEP_TYPE decides, as type_bit()s
+    uint16_t typed_hidden;  //< The ones of them it hides
+    bool matched;           //< The verdict on a path the patterns match
+    bool otherwise;         //< The verdict on a path no step decided
+};
+
+/** All the rules read from the config file.
+ *
+ * A filter_set is never modified once read_config() has built it. Reloading
+ * the config builds a new one and swaps it in, while the callbacks already
+ * running keep using the snapshot they started with. */
+struct filter_set {
+    uint64_t generation;    //< Tells cached results of different configs apart
+    uint64_t fingerprint;   //< Hash of the rules, tells which ones a verdict index was built with
+
+    std::unique_ptr<literal_matcher> literals;  //< NULL if no pattern is a plain literal
+    std::unique_ptr<pattern_matcher> matcher;   //< NULL if all the RegEx patterns are literals
+    uint16_t modes = 0;     //< The file types of the type: lines, as type_bit()s
+    std::unordered_multimap<std::string, std::string> extPriority;
+    std::unordered_set<std::string> extPriorityWinners;    //< All the extensions that can hide another one
+    std::unique_ptr<pattern_matcher> direct_io;     //< Files read around the page cache, if any
+    std::unique_ptr<pattern_matcher> keep_cache;    //< Files whose cached pages are kept, if any
+    rule_program program = {};
+
+    /** With the view option, the rules of each view, in the order of
+     * conf views. They share the generation of this filter_set, which has no
+     * patterns of its own, and extPriority and extPriorityWinners of all of
+     * them, so the caches of the source serve every view. */
+    std::vector<std::unique_ptr<filter_set>> views;
+};
+
+/** The names in one source directory that have one of the extPriorityWinners
+ * extensions of a filter_set. Lets should_hide() resolve extensionPriority with hash lookups
+ * instead of probing the file system once per higher priority extension. */
+struct dir_index {
+    struct timespec mtime;  //< The directory mtime the names were read at
+    std::unordered_map<std::string, unsigned char> names;  //< name -> d_type
+};
+
+struct dir_index_entry {
+    std::chrono::steady_clock::time_point expires;  //< When to check the mtime again
+    uint64_t generation;    //< The filter_set the index was built for
+    std::shared_ptr<const dir_index> index;
+};
+
+static const size_t dir_index_cache_max_entries = 1024;
+extern lru_cache<std::string, dir_index_entry> dir_index_cache;
+
+/* Threading contract
+ *
+ * fuse_main() runs the callbacks on many threads at once. Everything they
+ * share falls in one of these groups:
+ *   - conf is only written by main() before fuse_main() is called.
+ *   - The rules are a filter_set. It is published once by main() and again
+ *     on every reload, and never modified after that. Callbacks get to it
+ *     through a filter_ref, which pins the published filter_set for the
+ *     current thread. Taking a filter_ref is a single atomic load unless the
+ *     rules changed since this thread last looked. Nested filter_refs see the
+ *     same snapshot, so a callback never mixes rules from two configs.
+ *   - The caches (attr_cache, dir_index_cache) lock internally and only hand
+ *     out copies. Their entries remember the filter_set generation they were
+ *     computed with, and entries from another generation count as misses.
+ *     The directory verdicts, looked up for every ancestor of every path,
+ *     are also copied into a cache of each thread's own, so the lookups that
+ *     hit it take no lock.
+ *
+ * So the callbacks need no locking of their own, and the number of FUSE
+ * threads can be raised as needed.
+ */
+
+
+extern std::mutex filters_lock;                    //< Only taken when the rules change
+extern std::shared_ptr<const filter_set> filters;  //< The published rules, guarded by filters_lock
+extern std::atomic<uint64_t> filters_published;    //< The generation of "filters"
+
+/** Make "fs" the rules in effect for all the callbacks started from now on */
+void publish_filters(std::shared_ptr<const filter_set> fs);
+
+/** A snapshot of the rules currently in effect, valid for as long as the
+ * filter_ref is alive. Each thread keeps its own reference to the last
+ * filter_set it saw, and only goes back to "filters" when a newer one has been
+ * published and the thread isn't already using the old one. */
+class filter_ref {
+public:
+    filter_ref() {
+        thread_local_state &state = local();
+        if (state.pins == 0 && (!state.snapshot ||
+                    state.snapshot->generation != filters_published.load(std::memory_order_acquire))) {
+            std::lock_guard<std::mutex> guard(filters_lock);
+            state.snapshot = filters;
+        }
+        state.pins++;
+        fs = state.snapshot.get();
+    }
+
+    ~filter_ref() {
+        local().pins--;
+    }
+
+    const filter_set &operator*() const { return *fs; }
+    const filter_set *operator->() const { return fs; }
+
+    filter_ref(const filter_ref&) = delete;
+    void operator = (const filter_ref&) = delete;
+
+private:
+    struct thread_local_state {
+        std::shared_ptr<const filter_set> snapshot;
+        unsigned pins = 0;
+    };
+
+    static thread_local_state &local() {
+        static thread_local thread_local_state state;
+        return state;
+    }
+
+    const filter_set *fs;
+};
+
+/** Read the RegEx configuration file into "fs" */
+int read_config(const std::filesystem::path &conf_file, filter_set &fs);
+
+/** Read the rules of the mount into "fs": the config option's file, or the
+ * file of each view with the view option.
+ *
+ * @param failed Receives the file that could not be read, if any */
+int read_filters(filter_set &fs, std::string &failed);
+
+/** The rules "path" is filtered with: those of the view it is seen through,
+ * with "path" moved past the name of the view. Without views, "fs" itself.
+ *
+ * @return NULL for the root and the names that aren't views */
+const filter_set *view_filters(const filter_set &fs, const char *&path);
+
+std::shared_ptr<dir_index> new_dir_index(const struct stat &dir_st);
+void cache_dir_index(const filter_set &fs, const std::string &dir, std::shared_ptr<const dir_index> index);
+
+/** Record a directory entry in the index if it might hide one of its siblings */
+void dir_index_add(const filter_set &fs, dir_index &index, const char *name, unsigned char type);
+
+/** A source directory the way the mount shows it. With several branches,
+ * the entries of all the branches that have the directory are merged, and
+ * a name that is in more than one of them is taken from the first one.
+ *
+ * The entries are read with getdents64() in large batches and kept as arrays,
+ * with all the names in one buffer, so a listing takes a handful of
+ * allocations however many entries it has. */
+class source_dir {
+public:
+    source_dir() {}
+    ~source_dir() { close_all(); }
+
+    /** @param list Read the entries as well
+     * @return 0, or -errno if none of the branches has the directory */
+    int open(const char *relpath, bool list = true);
+
+    /** The attributes of the directory in the first branch that has it, with
+     * the latest mtime of all of them (as source_stat() has it) */
+    const struct stat &stat() const { return st; }
+
+    /** The directory in each branch, -1 where it isn't */
+    const int *fds() const { return dir_fds.data(); }
+
+    /** The number of entries, ".." and "." included */
+    size_t size() const { return name_at.size(); }
+    const char *name(size_t i) const { return names.data() + name_at[i]; }
+    ino_t ino(size_t i) const { return inos[i]; }
+    /** The d_type of an entry, DT_UNKNOWN if the file system didn't say */
+    unsigned char type(size_t i) const { return types[i]; }
+    /** The branch an entry was read from */
+    unsigned branch(size_t i) const { return entry_branches[i]; }
+
+    /** Stat the entries of type DT_UNKNOWN, the others are left alone. The
+     * ones that can't be stat()ed stay DT_UNKNOWN, and are logged.
+     *
+     * @param path The rofs path of the directory, for the log */
+    void resolve_types(const char *path);
+
+    source_dir(const source_dir&) = delete;
+    void operator = (const source_dir&) = delete;
+
+private:
+    void close_all();
+    int read_entries(int fd, unsigned branch);
+    void add(const char *name, size_t len, ino_t ino, unsigned char type, unsigned branch);
+    void drop_duplicates();
+
+    struct stat st;
+    std::vector<int> dir_fds;
+
+    std::vector<char> names;            //< NUL-terminated, one after the other
+    std::vector<uint32_t> name_at;      //< Where each entry's name starts in "names"
+    std::vector<ino_t> inos;
+    std::vector<unsigned char> types;
+    std::vector<unsigned> entry_branches;
+};
+
+/** Run the rules of "fs" on a path: hide it if the file name matches one of
+ * the RegEx patterns, or loses to a sibling on extensionPriority. With views,
+ * the rules of the view the path is in, and only the views are shown in the
+ * root. Use should_hide(), which takes the verdict from the index option's file
+ * when it can.
+ *
+ * @param index The index of the directory containing the file, if the caller
+ * has one at hand. */
+int evaluate_rules(const filter_set &fs, const char *name, mode_t mode, const dir_index *index);
+
+/** Decide whether a path should be hidden. Everything below a hidden
+ * directory is hidden as well.
+ *
+ * @param mode The file type of the path
+ * @param index The entries of its directory, to resolve extensionPriority
+ * with, if the caller has them. */
+int should_hide(const filter_set &fs, const char *name, mode_t mode, const dir_index *index = NULL);
+int should_hide(const char *name, mode_t mode);
+
+void cache_dir_verdict(const filter_set &fs, const std::string &dir, bool hidden);
+
+/** What walk_tree() found in one directory */
+struct walked_dir {
+    struct entry {
+        std::string path;
+        mode_t mode;        //< Only the file type bits
+        int hide;           //< evaluate_rules() verdict
+        unsigned branch;    //< The source branch it was found in
+        bool have_st;       //< "st" was filled in
+        struct stat st;
+    };
+
+    std::string path;
+    struct stat st;
+    std::shared_ptr<dir_index> index;   //< As get_dir_index() would build it
+    std::vector<entry> entries;
+};
+
+unsigned walk_threads();
+
+/** Walk the part of the source tree that can be reached through visible
+ * directories, on walk_threads() threads, and evaluate the rules for every
+ * entry. Threads that run out of directories take some from the others, so
+ * deep and wide subtrees are shared out alike.
+ *
+ * @param need_stat Stat every entry, instead of relying on d_type
+ * @param stop Checked between directories, to give up early
+ * @param visit Called with each walked_dir, from any of the threads
+ * @return false if the walk was stopped */
+template<class Visit>
+bool walk_tree(const filter_set &fs, bool need_stat, const std::atomic<bool> &stop, Visit &&visit) {
+    // With views, each one is walked on its own, since they hide different
+    // directories
+    std::vector<std::string> roots;
+    for (const auto &view : views) roots.push_back("/" + view.name);
+    if (roots.empty()) roots.push_back("/");
+
+    work_stealing_pool<std::string>::run(walk_threads(), std::move(roots), [&](std::string &dir, auto &&push) {
+        if (stop.load(std::memory_order_relaxed)) return;
+
+        // Read the whole directory first, so extensionPriority can be
+        // resolved from the listing itself.
+        source_dir source;
+        int res = source.open(relative_path(dir.c_str()));
+        if (res) {
+            log_msg(LOG_WARNING, "%s: Can not read %s: %s", PACKAGE_STRING, dir.c_str(), strerror(-res));
+            return;
+        }
+
+        walked_dir walked;
+        walked.st = source.stat();
+        walked.path = std::move(dir);
+        walked.index = new_dir_index(walked.st);
+        if (!fs.extPriority.empty()) {
+            for (size_t i = 0; i < source.size(); i++) {
+                dir_index_add(fs, *walked.index, source.name(i), source.type(i));
+            }
+        }
+
+        const std::string prefix = walked.path == "/" ? walked.path : walked.path + '/';
+        walked.entries.resize(source.size());
+        size_t count = 0;
+        for (size_t i = 0; i < source.size(); i++) {
+            const char *name = source.name(i);
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+            walked_dir::entry &e = walked.entries[count];
+            e.path.assign(prefix).append(name);
+            e.mode = DTTOIF(source.type(i));
+            e.branch = source.branch(i);
+            e.have_st = false;
+            if (need_stat || source.type(i) == DT_UNKNOWN) {
+                e.have_st = fstatat(source.fds()[e.branch], name, &e.st, AT_SYMLINK_NOFOLLOW) == 0;
+                if (!e.have_st && source.type(i) == DT_UNKNOWN) continue;
+                if (e.have_st) e.mode = e.st.st_mode & S_IFMT;
+            }
+
+            e.hide = evaluate_rules(fs, e.path.c_str(), e.mode, walked.index.get());
+            if (!e.hide && S_ISDIR(e.mode)) push(e.path);
+            count++;
+        }
+        walked.entries.resize(count);
+
+        visit(walked);
+    });
+
+    return !stop.load(std::memory_order_relaxed);
+}
+
+/** Record the verdict of every path below the source directory that can be
+ * reached through visible directories, and write them to "file".
+ *
+ * @param stop Checked between directories, to give up early
+ * @return 0, or -errno */
+int build_index(const filter_set &fs, const std::string &file, const std::atomic<bool> &stop);
+
+/** Map an index built by build_index() and start serving verdicts from it.
+ *
+ * @return 0, -ESTALE if it was built for other rules, or another -errno */
+int load_index(const filter_set &fs, const std::string &file);
+
+/** Build the index in the background when the mount found it missing or out
+ * of date. The rules are evaluated as usual until it's ready. Called again
+ * once reloaded rules are published, it stops a build for the previous ones
+ * and starts one for the new ones. */
+void start_index_thread();
+void stop_index_thread();
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <string.h>
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/** Handles the patterns that are just a literal string, optionally anchored at
+ * either end, such as ".*\\.flac$", "/subDir2$" or "^/tmp/". Those are by far
+ * the most common ones, and a few hash lookups are much cheaper than
+ * running them through the regex engine. */
+class literal_matcher {
+public:
+    /** Add the pattern if it's a plain literal.
+     * @return false if the pattern needs the regex engine. */
+    bool add(const std::string &pattern) {
+        std::string lit;
+        bool at_start, at_end;
+        if (!parse(pattern, lit, at_start, at_end)) return false;
+
+        storage.push_back(lit);
+        std::string_view view(storage.back());
+        if (at_start && at_end) {
+            exact.insert(view);
+        } else if (at_start) {
+            insert_by_length(prefixes, view);
+        } else if (at_end) {
+            insert_by_length(suffixes, view);
+        } else {
+            substrings.push_back(view);
+        }
+        return true;
+    }
+
+    bool empty() const { return storage.empty(); }
+
+    bool match(std::string_view path) const {
+        if (exact.count(path)) return true;
+
+        for (const auto &bucket : prefixes) {
+            if (bucket.first > path.size()) break;
+            if (bucket.second.count(path.substr(0, bucket.first))) return true;
+        }
+        for (const auto &bucket : suffixes) {
+            if (bucket.first > path.size()) break;
+            if (bucket.second.count(path.substr(path.size() - bucket.first))) return true;
+        }
+        for (const auto &sub : substrings) {
+            if (path.find(sub) != std::string_view::npos) return true;
+        }
+        return false;
+    }
+
+private:
+    typedef std::unordered_set<std::string_view> literal_set;
+    /** Literals grouped by length, shortest first */
+    typedef std::vector<std::pair<size_t, literal_set>> literals_by_length;
+
+    static void insert_by_length(literals_by_length &table, std::string_view lit) {
+        auto it = table.begin();
+        while (it != table.end() && it->first < lit.size()) ++it;
+        if (it == table.end() || it->first != lit.size()) {
+            it = table.emplace(it, lit.size(), literal_set());
+        }
+        it->second.insert(lit);
+    }
+
+    static bool is_special(char c) {
+        return strchr(".[]()*+?{}|^$\\", c) != NULL;
+    }
+
+    /** Split a pattern into its literal text and anchors. Leading and trailing
+     * ".*" are dropped since they don't change what an unanchored match finds. */
+    static bool parse(const std::string &pattern, std::string &lit, bool &at_start, bool &at_end) {
+        size_t begin = 0, end = pattern.size();
+
+        at_start = begin < end && pattern[begin] == '^';
+        if (at_start) begin++;
+        if (pattern.compare(begin, 2, ".*") == 0) {
+            begin += 2;
+            at_start = false;
+        }
+
+        // A trailing '$' is an anchor unless it is escaped
+        size_t backslashes = 0;
+        while (end > begin + 1 + backslashes && pattern[end - 2 - backslashes] == '\\') backslashes++;
+        at_end = end > begin && pattern[end - 1] == '$' && backslashes % 2 == 0;
+        if (at_end) end--;
+        if (end >= begin + 2 && pattern.compare(end - 2, 2, ".*") == 0
+                && (end < begin + 3 || pattern[end - 3] != '\\')) {
+            end -= 2;
+            at_end = false;
+        }
+
+        lit.clear();
+        for (size_t i = begin; i < end; i++) {
+            char c = pattern[i];
+            if (c == '\\') {
+                // Only escaped special characters are literals. Others, like
+                // \s or \<, are regex operators in glibc.
+                if (++i == end || !is_special(pattern[i])) return false;
+                lit += pattern[i];
+            } else if (is_special(c)) {
+                return false;
+            } else {
+                lit += c;
+            }
+        }
+        return !lit.empty();
+    }
+
+    std::deque<std::string> storage;    //< Owns the literals, never reallocates them
+    literal_set exact;
+    literals_by_length prefixes;
+    literals_by_length suffixes;
+    std::vector<std::string_view> substrings;
+};
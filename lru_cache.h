@@ -0,0 +1,90 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+/**
+Thread safe, size bounded cache that evicts the least recently used entry.
+
+lru_cache<std::string, int> cache(1000);
+cache.put("key", 42);
+
+int value;
+if (cache.get("key", value)) {
+    // hit
+}
+*/
+
+template<class Key, class Value>
+class lru_cache {
+public:
+    explicit lru_cache(size_t capacity = 0) : capacity(capacity) {}
+
+    void set_capacity(size_t new_capacity) {
+        std::lock_guard<std::mutex> guard(lock);
+        capacity = new_capacity;
+        trim();
+    }
+
+    /** Copy the cached value into "value" and mark the entry as recently used */
+    bool get(const Key &key, Value &value) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(key);
+        if (it == index.end()) return false;
+
+        items.splice(items.begin(), items, it->second);
+        value = it->second->second;
+        return true;
+    }
+
+    void put(const Key &key, const Value &value) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (capacity == 0) return;
+
+        auto it = index.find(key);
+        if (it != index.end()) {
+            it->second->second = value;
+            items.splice(items.begin(), items, it->second);
+            return;
+        }
+
+        items.emplace_front(key, value);
+        index.emplace(key, items.begin());
+        trim();
+    }
+
+    void erase(const Key &key) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(key);
+        if (it == index.end()) return;
+
+        items.erase(it->second);
+        index.erase(it);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        index.clear();
+        items.clear();
+    }
+
+    lru_cache(const lru_cache&) = delete;
+    void operator = (const lru_cache&) = delete;
+
+private:
+    void trim() {
+        while (items.size() > capacity) {
+            index.erase(items.back().first);
+            items.pop_back();
+        }
+    }
+
+    typedef std::list<std::pair<Key, Value>> list_type;
+
+    list_type items;
+    std::unordered_map<Key, typename list_type::iterator> index;
+    size_t capacity;
+    std::mutex lock;
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+Counters and latency histograms that any number of threads update without a
+lock, or even a shared cache line: every thread gets a set of its own, which
+only it writes to. Reading them adds up the sets of all the threads. When a
+thread exits, its set is handed to the next new thread, so the totals only
+ever grow.
+
+enum { READS, COUNTER_COUNT };
+enum { READ_LATENCY, HISTOGRAM_COUNT };
+static thread_metrics<COUNTER_COUNT, HISTOGRAM_COUNT> metrics;
+
+metrics.add(READS);
+metrics.record(READ_LATENCY, elapsed_ns);
+
+thread_metrics<COUNTER_COUNT, HISTOGRAM_COUNT>::totals t;
+metrics.collect(t);
+*/
+
+template<size_t Counters, size_t Histograms>
+class thread_metrics {
+public:
+    /** Bucket i of a histogram counts the samples below 2^i microseconds,
+     * except for the last one which counts all the rest. */
+    static const size_t buckets = 24;
+
+    struct histogram {
+        uint64_t count[buckets];
+        uint64_t sum_ns;
+    };
+
+    struct totals {
+        uint64_t counters[Counters];
+        histogram histograms[Histograms];
+    };
+
+    thread_metrics() {}
+
+    void add(size_t counter, uint64_t n = 1) {
+        bump(local().counters[counter], n);
+    }
+
+    void record(size_t hist, uint64_t ns) {
+        shard &s = local();
+        bump(s.buckets[hist][bucket(ns)], 1);
+        bump(s.sum_ns[hist], ns);
+    }
+
+    /** Add up what all the threads recorded so far */
+    void collect(totals &t) const {
+        memset(&t, 0, sizeof(t));
+
+        std::lock_guard<std::mutex> guard(lock);
+        for (const shard *s : shards) {
+            for (size_t i = 0; i < Counters; i++) {
+                t.counters[i] += s->counters[i].load(std::memory_order_relaxed);
+            }
+            for (size_t h = 0; h < Histograms; h++) {
+                for (size_t b = 0; b < buckets; b++) {
+                    t.histograms[h].count[b] += s->buckets[h][b].load(std::memory_order_relaxed);
+                }
+                t.histograms[h].sum_ns += s->sum_ns[h].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /** The bucket a sample of "ns" nanoseconds goes in */
+    static size_t bucket(uint64_t ns) {
+        const uint64_t us = ns / 1000;
+        const size_t b = us ? 64 - __builtin_clzll(us) : 0;
+        return b < buckets ? b : buckets - 1;
+    }
+
+    thread_metrics(const thread_metrics&) = delete;
+    void operator = (const thread_metrics&) = delete;
+
+private:
+    struct alignas(64) shard {
+        std::atomic<uint64_t> counters[Counters];
+        std::atomic<uint64_t> buckets[Histograms][thread_metrics::buckets];
+        std::atomic<uint64_t> sum_ns[Histograms];
+        bool in_use;    //< Guarded by lock
+    };
+
+    /** Gives the shard of a thread back when the thread exits */
+    struct owner {
+        thread_metrics *metrics = NULL;
+        shard *s = NULL;
+        ~owner() { if (s) metrics->release(s); }
+    };
+
+    /** Only the owning thread writes to a shard, so a plain load and store is
+     * enough, and cheaper than an atomic add. */
+    static void bump(std::atomic<uint64_t> &v, uint64_t n) {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    shard &local() {
+        // Per type, not per instance, so there must only be one instance
+        static thread_local owner mine;
+        if (mine.s == NULL) {
+            mine.metrics = this;
+            mine.s = acquire();
+        }
+        assert(mine.metrics == this);
+        return *mine.s;
+    }
+
+    shard *acquire() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (shard *s : shards) {
+            if (!s->in_use) {
+                s->in_use = true;
+                return s;
+            }
+        }
+
+        // Never freed, threads may still be running when the process exits
+        shard *s = new shard();
+        for (auto &c : s->counters) c.store(0, std::memory_order_relaxed);
+        for (auto &h : s->buckets) for (auto &b : h) b.store(0, std::memory_order_relaxed);
+        for (auto &sum : s->sum_ns) sum.store(0, std::memory_order_relaxed);
+        s->in_use = true;
+        shards.push_back(s);
+        return s;
+    }
+
+    void release(shard *s) {
+        std::lock_guard<std::mutex> guard(lock);
+        s->in_use = false;
+    }
+
+    mutable std::mutex lock;        //< Guards shards and their in_use flags
+    std::vector<shard *> shards;
+};
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+
+/**
+Bounded, lock-free queue that any number of threads can push to and pop from.
+Size must be a power of two. Values are filled in and read out in place, so
+large records don't need to be copied around.
+
+ring_buffer<record, 1024> *ring = new ring_buffer<record, 1024>();
+
+bool queued = ring->push([&](record &r) {
+    // fill in r
+});
+
+ring->pop([&](record &r) {
+    // read r
+});
+*/
+
+template<class T, size_t Size>
+class ring_buffer {
+    static_assert(Size >= 2 && (Size & (Size - 1)) == 0, "Size must be a power of two");
+
+public:
+    ring_buffer() : head(0), tail(0) {
+        for (size_t i = 0; i < Size; i++) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /** Fill in the next free slot with "fill(T&)".
+     * @return false if the ring is full. */
+    template<class Fill>
+    bool push(Fill &&fill) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;) {
+            c = &cells[pos & (Size - 1)];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+
+        fill(c->data);
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Hand the oldest value to "consume(T&)" and free up its slot.
+     * @return false if the ring is empty. */
+    template<class Consume>
+    bool pop(Consume &&consume) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;) {
+            c = &cells[pos & (Size - 1)];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        consume(c->data);
+        c->seq.store(pos + Size, std::memory_order_release);
+        return true;
+    }
+
+    /** Whether there is nothing to pop. Only exact for the one thread that
+     * pops, the others may be pushing at the same time. */
+    bool empty() const {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        return cells[pos & (Size - 1)].seq.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    ring_buffer(const ring_buffer&) = delete;
+    void operator = (const ring_buffer&) = delete;
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    cell cells[Size];
+    alignas(64) std::atomic<size_t> head;  //< Next slot to fill
+    alignas(64) std::atomic<size_t> tail;  //< Next slot to read
+};
+
+/**
+Lets the one thread that pops a ring_buffer sleep while it is empty, and stop
+once the threads pushing to it are done.
+
+if (wakeup.enter()) {
+    ring->push(...);
+    wakeup.leave();
+}
+
+while (wakeup.wait([&]() { return ring->empty(); })) {
+    while (ring->pop(...)) {}
+}
+while (ring->pop(...)) {}     // What was pushed before stop()
+*/
+class ring_wakeup {
+public:
+    ring_wakeup() : pushers(0), active(false), stopped(false), sleeping(false) {}
+
+    void start() {
+        stopped.store(false, std::memory_order_relaxed);
+        active.store(true, std::memory_order_seq_cst);
+    }
+
+    /** For the threads pushing: false once stop() was called, in which case
+     * they must not push. Otherwise leave() must follow. */
+    bool enter() {
+        pushers.fetch_add(1, std::memory_order_seq_cst);
+        if (active.load(std::memory_order_seq_cst)) return true;
+        pushers.fetch_sub(1, std::memory_order_release);
+        return false;
+    }
+
+    /** After pushing, or failing to push */
+    void leave() {
+        pushers.fetch_sub(1, std::memory_order_release);
+        // Pairs with the fence in wait(): either the popping thread sees what
+        // was pushed, or this sees it going to sleep
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) notify();
+    }
+
+    /** Turn new pushes away. What was pushed so far can still be popped. */
+    void close() { active.store(false, std::memory_order_seq_cst); }
+
+    /** close(), then wait for the threads pushing to finish and wake up the
+     * popping thread for the last time */
+    void stop() {
+        close();
+        while (pushers.load(std::memory_order_acquire)) std::this_thread::yield();
+        stopped.store(true, std::memory_order_release);
+        notify();
+    }
+
+    /** For the popping thread: sleep until "empty()" is false or stop() was
+     * called.
+     * @return false once stop() was called, when nothing else will be
+     * pushed */
+    template<class Empty>
+    bool wait(Empty &&empty) {
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cond.wait(guard, [&]() { return stopped.load(std::memory_order_acquire) || !empty(); });
+        }
+        sleeping.store(false, std::memory_order_relaxed);
+        return !stopped.load(std::memory_order_acquire);
+    }
+
+    ring_wakeup(const ring_wakeup&) = delete;
+    void operator = (const ring_wakeup&) = delete;
+
+private:
+    void notify() {
+        std::lock_guard<std::mutex> guard(lock);
+        cond.notify_one();
+    }
+
+    std::atomic<unsigned> pushers;  //< Between enter() and leave()
+    std::atomic<bool> active;
+    std::atomic<bool> stopped;
+    std::atomic<bool> sleeping;     //< The popping thread is in wait()
+    std::mutex lock;
+    std::condition_variable cond;
+};
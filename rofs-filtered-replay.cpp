@@ -0,0 +1,213 @@
+/* vi:ai:tabstop=8:shiftwidth=4:softtabstop=4:expandtab
+ *
+ * Plays back a trace recorded with the trace option against a mount, as fast
+ * as it can or with the timing of the recording, and prints how long each
+ * kind of call took then and now as JSON.
+ *
+ *   rofs-filtered-replay TRACE MOUNT [--timed] [--speed X] [--threads N]
+ *
+ * Each call is made through the mount the way a program would make it:
+ * lookups and getattrs become lstat(), opendirs list the whole directory (so
+ * the readdirs that followed them are skipped), reads go to a descriptor
+ * opened once per file. The names of getxattrs aren't recorded, so they ask
+ * for a name that doesn't exist.
+ */
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "trace.h"
+
+struct replay_options {
+    bool timed = false;         //< Wait for the time each call was made at
+    double speed = 1;           //< How much faster than recorded, when timed
+    unsigned threads = 8;
+};
+
+struct traced_call {
+    trace_format::record r;
+    std::string path;
+};
+
+/** What was replayed of one kind of call */
+struct op_totals {
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    uint64_t replay_ns = 0;
+    uint64_t recorded_ns = 0;
+};
+
+/** The descriptors reads are made on, opened on first use */
+class file_table {
+public:
+    ~file_table() {
+        for (const auto &f : files) if (f.second != -1) close(f.second);
+    }
+
+    int get(const std::string &path) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = files.find(path);
+        if (it == files.end()) it = files.emplace(path, open(path.c_str(), O_RDONLY | O_CLOEXEC)).first;
+        return it->second;
+    }
+
+private:
+    std::mutex lock;
+    std::unordered_map<std::string, int> files;
+};
+
+/** Make one call on "path", the mount-relative path prefixed with the mount.
+ * @return false if it failed */
+static bool replay(const trace_format::record &r, const std::string &path, file_table &files,
+                   std::vector<char> &buf) {
+    struct stat st;
+    switch (r.op) {
+    case OP_LOOKUP:
+    case OP_GETATTR:
+        return lstat(path.c_str(), &st) == 0;
+    case OP_READLINK:
+        return readlink(path.c_str(), buf.data(), buf.size()) != -1;
+    case OP_OPEN: {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return false;
+        close(fd);
+        return true;
+    }
+    case OP_READ: {
+        int fd = files.get(path);
+        if (buf.size() < r.size) buf.resize(r.size);
+        return fd != -1 && pread(fd, buf.data(), r.size, r.offset) != -1;
+    }
+    case OP_OPENDIR: {
+        DIR *dp = opendir(path.c_str());
+        if (dp == NULL) return false;
+        while (readdir(dp) != NULL) {}
+        closedir(dp);
+        return true;
+    }
+    case OP_STATFS: {
+        struct statvfs sv;
+        return statvfs(path.c_str(), &sv) == 0;
+    }
+    case OP_ACCESS:
+        return access(path.c_str(), r.offset & (R_OK | W_OK | X_OK)) == 0;
+    case OP_GETXATTR:
+        return lgetxattr(path.c_str(), "user.rofs-filtered-replay", NULL, 0) != -1 || errno == ENODATA;
+    case OP_LISTXATTR:
+        return llistxattr(path.c_str(), NULL, 0) != -1;
+    default:
+        return true;
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: rofs-filtered-replay TRACE MOUNT [--timed] [--speed X] [--threads N]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    replay_options opts;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg[0] != '-') args.push_back(arg);
+        else if (arg == "--timed") opts.timed = true;
+        else if (i + 1 == argc) usage();
+        else if (arg == "--speed") opts.speed = atof(argv[++i]);
+        else if (arg == "--threads") opts.threads = std::max(1, atoi(argv[++i]));
+        else usage();
+    }
+    if (args.size() != 2 || opts.speed <= 0) usage();
+    const std::string &mount = args[1];
+
+    trace_reader trace;
+    int res = trace.open(args[0]);
+    if (res) {
+        fprintf(stderr, "rofs-filtered-replay: can not read %s: %s\n", args[0].c_str(),
+                res == -EINVAL ? "not a trace" : strerror(-res));
+        return 1;
+    }
+
+    std::vector<traced_call> calls;
+    traced_call call;
+    while (trace.next(call.r, call.path)) {
+        if (call.r.op >= OP_COUNT || call.r.op == OP_READDIR) continue;
+        call.path.insert(0, mount);
+        calls.push_back(std::move(call));
+    }
+    // The trace has the calls in the order they ended
+    std::stable_sort(calls.begin(), calls.end(), [](const traced_call &a, const traced_call &b) {
+        return a.r.start_ns < b.r.start_ns;
+    });
+
+    file_table files;
+    std::atomic<size_t> next(0);
+    std::vector<std::vector<op_totals>> totals(opts.threads, std::vector<op_totals>(OP_COUNT));
+    const uint64_t first_ns = calls.empty() ? 0 : calls.front().r.start_ns;
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < opts.threads; t++) {
+        workers.emplace_back([&, t]() {
+            std::vector<char> buf(PATH_MAX);
+            for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < calls.size(); ) {
+                const traced_call &c = calls[i];
+                if (opts.timed) {
+                    std::this_thread::sleep_until(start + std::chrono::nanoseconds(
+                            (uint64_t)((c.r.start_ns - first_ns) / opts.speed)));
+                }
+
+                uint64_t begin = now_ns();
+                bool ok = replay(c.r, c.path, files, buf);
+                op_totals &op = totals[t][c.r.op];
+                op.replay_ns += now_ns() - begin;
+                op.recorded_ns += c.r.duration_ns;
+                op.calls++;
+                if (!ok) op.errors++;
+            }
+        });
+    }
+    for (auto &w : workers) w.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("{\"calls\": %zu, \"seconds\": %.3f, \"calls_per_s\": %.0f, \"ops\": {",
+           calls.size(), seconds, seconds > 0 ? calls.size() / seconds : 0);
+    const char *sep = "";
+    for (unsigned op = 0; op < OP_COUNT; op++) {
+        op_totals sum;
+        for (const auto &thread : totals) {
+            sum.calls += thread[op].calls;
+            sum.errors += thread[op].errors;
+            sum.replay_ns += thread[op].replay_ns;
+            sum.recorded_ns += thread[op].recorded_ns;
+        }
+        if (sum.calls == 0) continue;
+        printf("%s\"%s\": {\"calls\": %llu, \"errors\": %llu, \"mean_us\": %.1f, \"recorded_mean_us\": %.1f}",
+               sep, op_names[op], (unsigned long long)sum.calls, (unsigned long long)sum.errors,
+               sum.replay_ns / 1e3 / sum.calls, sum.recorded_ns / 1e3 / sum.calls);
+        sep = ", ";
+    }
+    printf("}}\n");
+    return 0;
+}
@@ -21,7 +21,7 @@
  * ROFS - The read-only filesystem for FUSE.
  *
  * On Ubuntu/Debian install: libfuse2, libfuse-dev, fuse-utils
- * Version 2.5 or later of FUSE is required. If needed, it can be obtained from
+ * Version 2.9 or later of FUSE is required. FUSE 3 is also supported. If needed, it can be obtained from
  * debuntu.org by adding the following line to /etc/apt/sources.list:
  *      deb http://repository.debuntu.org/ dapper multiverse
  *
@@ -67,17 +67,38 @@
 #define lsetxattr(path, name, value, size, flags) (setxattr(path, name, value, size, 0, flags | XATTR_NOFOLLOW))
 #endif
 
+// O_PATH opens a file without reading it, if the platform has it
+#ifdef O_PATH
+#define O_PATH_OR_RDONLY O_PATH
+#else
+#define O_PATH_OR_RDONLY O_RDONLY
+#endif
+
 // We depend on version 2.5 of FUSE because it provides an "access" callback.
 // Some applications would call "access" and figure out a file is writable
 // (which was the default behavior of "access" prior to 2.5), then attempt to
 // open the file "rw", fail, and bomb out because of the conflicting info.
-#define FUSE_USE_VERSION 25
+// Version 2.9 adds the "read_buf" callback used by the splice_read option.
+// FUSE 3 (the WITH_FUSE3 build option) adds readdirplus and the low-level
+// API (the WITH_LOWLEVEL build option).
+#if HAVE_FUSE3
+#define FUSE_USE_VERSION 31
+#else
+#define FUSE_USE_VERSION 29
+#endif
 
+#include "common.h"
+#include "filter.h"
 #include "scope_guard.h"
+#include "lru_cache.h"
+#if HAVE_LIBURING
+#include "uring_queue.h"
+#endif
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/sysmacros.h>
 #include <strings.h>
 #include <unistd.h>
 
@@ -86,20 +107,33 @@
 #include <errno.h>
 #include <stddef.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/xattr.h>
-#include <regex.h>
 #include <syslog.h>
 #include <fuse.h>
 
+#if USE_LOWLEVEL
+#include <fuse_lowlevel.h>
+#endif
+
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
 // AC_HEADER_STDC
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <string>
-#include <sstream>
 #include <filesystem>
-#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_set>
 #include <unordered_map>
 
@@ -121,27 +155,16 @@
 # endif
 #endif
 
-// Some hard-coded values for use with syslog
-static const char *EXEC_NAME = "rofs-filtered";
-static const int log_facility = LOG_DAEMON;
-
-struct rofs_config {
-    const char *rw_path;
-    const char *config;
-    int invert;
-    int debug;
-    int preserve_perms;
-};
-
-// Global to store our configuration (the option parsing results)
-struct rofs_config conf;
-
 enum {
     KEY_HELP,
     KEY_VERSION,
     KEY_DEBUG,
+    KEY_BUILD_INDEX,
+    KEY_SOURCE,
+    KEY_VIEW,
 };
 
+static std::vector<std::string> source_paths;   //< The source options, in order
 
 #ifdef SYSCONF_DIR
 const char *default_config_file = SYSCONF_DIR "/rofs-filtered.rc";
@@ -149,213 +172,252 @@ const char *default_config_file = SYSCONF_DIR "/rofs-filtered.rc";
 const char *default_config_file = "/etc/rofs-filtered.rc";
 #endif
 
-regex_t pattern;
-bool hasPattern;
-std::unordered_set<mode_t> modes;
-std::unordered_multimap<std::string, std::string> extPriority;
-
-/** Log a message to syslog and stderr */
-static inline void log_msg(const int level, const char *format, ... /*args*/) {
-    if (level == LOG_DEBUG && !conf.debug) return;
+static const unsigned default_uring_depth = 256;
+
+/** What callback_getattr() and friends need to know about a source path.
+ * Cached for conf.attr_cache_ttl seconds when the attribute cache is enabled.
+ * The views share the entries, with a verdict each. */
+struct attr_entry {
+    std::chrono::steady_clock::time_point expires;
+    uint64_t generation;    //< The filter_set the verdicts were computed with
+    int err;            //< 0, or the -errno returned by fstatat()
+    uint64_t judged;    //< The views (bits) "hidden" has a verdict for, only valid if err == 0
+    uint64_t hidden;    //< The views that hide the path
+    unsigned branch;    //< The source branch the path is in, only valid if err == 0
+    bool full;          //< st has all the attributes, not only the file type
+    struct stat st;
+};
 
-    va_list ap;
+/** Keyed by relative_path() */
+static lru_cache<std::string, attr_entry> attr_cache;
 
-    va_start(ap, format);
-    vsyslog(log_facility | level, format, ap);
-    va_end(ap);
+/** What a source file looked like when it was last opened (keep_cache=mtime) */
+struct open_stamp {
+    struct timespec mtime;
+    off_t size;
+};
 
-    va_start(ap, format);
-    vfprintf(stderr, format, ap);
-    va_end(ap);
-    fprintf(stderr, "\n");
+static lru_cache<std::string, open_stamp> open_stamps(default_attr_cache_max_entries);
+
+#if HAVE_LIBURING
+/** Where the calls on the source go, when it could be set up */
+static uring_queue uring;
+
+static void statx_to_stat(const struct statx &stx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    st->st_ino = stx.stx_ino;
+    st->st_mode = stx.stx_mode;
+    st->st_nlink = stx.stx_nlink;
+    st->st_uid = stx.stx_uid;
+    st->st_gid = stx.stx_gid;
+    st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    st->st_size = stx.stx_size;
+    st->st_blksize = stx.stx_blksize;
+    st->st_blocks = stx.stx_blocks;
+    st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
 }
+#endif
 
-/** Translate an rofs path into its underlying filesystem path.
+/** Stat the underlying file and decide whether it should be hidden.
  *
- * @param path The full path, relative to the rofs mount point. For example, if
- * the rofs is mounted at /a/path and there's a /a/path/file, the 'ls /a/path'
- * command will result in calls to this function with the path argument set to
- * "/" and "/file". */
-static std::filesystem::path translate_path(const std::filesystem::path &path) {
-    return conf.rw_path / path.relative_path();
+ * Goes through the attribute cache when it's enabled (attr_cache_ttl option).
+ *
+ * @param st If NULL, only the file type is fetched (source_type()), which is
+ * all the verdict needs: the callbacks other than getattr only want to know
+ * whether the path is there to be seen.
+ * @param branch If not NULL, receives the source branch the path is in
+ * @return 0 on success, -errno if the stat failed. */
+static int get_attr(const char *path, struct stat *st, int *hide, unsigned *branch = NULL) {
+    attr_entry entry;
+    auto now = std::chrono::steady_clock::now();
+    filter_ref fs;
+
+    // The root and the names that aren't views only take a verdict, without
+    // rules to run, so they are left out of the cache
+    const int view = path_view(path);
+    const bool cache = conf.attr_cache_ttl > 0 && view >= 0;
+    const uint64_t view_bit = 1ull << (view >= 0 ? view : 0);
+
+    auto reply = [&]() {
+        if (st) *st = entry.st;
+        *hide = (entry.hidden & view_bit) != 0;
+        if (branch) *branch = entry.branch;
+        return entry.err;
+    };
+
+    static thread_local std::string key;
+    if (cache && attr_cache.get(key.assign(relative_path(path)), entry)
+            && now < entry.expires && entry.generation == fs->generation && (entry.full || !st)) {
+        metric_add(METRIC_ATTR_CACHE_HITS);
+        if (entry.err || (entry.judged & view_bit)) return reply();
+
+        // Another view had the source stat()ed already
+        entry.judged |= view_bit;
+        if (should_hide(*fs, path, entry.st.st_mode)) entry.hidden |= view_bit;
+        attr_cache.put(key, entry);
+        return reply();
+    }
+    if (cache) metric_add(METRIC_ATTR_CACHE_MISSES);
+
+    memset(&entry.st, 0, sizeof(entry.st));
+    entry.branch = 0;
+    entry.full = st != NULL;
+    entry.err = (entry.full ? source_stat(relative_path(path), &entry.st, AT_SYMLINK_NOFOLLOW, &entry.branch)
+                 : source_type(relative_path(path), &entry.st.st_mode, AT_SYMLINK_NOFOLLOW, &entry.branch))
+                ? -errno : 0;
+    entry.judged = view_bit;
+    entry.hidden = !entry.err && should_hide(*fs, path, entry.st.st_mode) ? view_bit : 0;
+    entry.generation = fs->generation;
+
+    if (cache) {
+        entry.expires = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(conf.attr_cache_ttl));
+        attr_cache.put(key, entry);
+    }
+    return reply();
 }
 
-/** Report user-friendly regex errors */
-static void log_regex_error(int error, regex_t *regex, const char* pattern) {
-    size_t msg_len;
-    char *err_msg;
-
-    msg_len = regerror(error, regex, NULL, 0);
-    err_msg = (char *)malloc(msg_len);
-
-    if (err_msg) {
-        regerror(error, regex, err_msg, msg_len);
-        log_msg(LOG_ERR, "RegEx error: \"%s\" while parsing pattern: \"%s\"",
-                err_msg, pattern);
-        //printf("Error: %s %s\n", err_msg, pattern);
-        free(err_msg);
-    }
+/** Walk the source tree before mounting (prewarm option), so the first scan
+ * finds the attribute and extensionPriority caches filled, and the source
+ * file system's own caches hot. The low-level build keeps the attributes with
+ * its inodes, which only the kernel's lookups create, so it doesn't stat the
+ * entries for the attribute cache. */
+static void prewarm(const filter_set &fs) {
+#if USE_LOWLEVEL
+    const bool cache_attrs = false;
+#else
+    const bool cache_attrs = conf.attr_cache_ttl > 0;
+#endif
+    const auto start = std::chrono::steady_clock::now();
+    const auto expires = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(conf.attr_cache_ttl));
+    std::atomic<size_t> paths(0);
+    std::atomic<bool> stop(false);
+
+    walk_tree(fs, cache_attrs, stop, [&](const walked_dir &dir) {
+        const char *dir_path = dir.path.c_str();
+        const uint64_t view_bit = 1ull << path_view(dir_path, &dir_path);
+        if (!fs.extPriority.empty()) cache_dir_index(fs, dir_path, dir.index);
+        for (const auto &e : dir.entries) {
+            if (S_ISDIR(e.mode)) cache_dir_verdict(fs, e.path, e.hide);
+        }
+        if (cache_attrs) {
+            attr_entry entry, cached;
+            entry.expires = expires;
+            entry.generation = fs.generation;
+            entry.err = 0;
+            entry.full = true;
+            for (const auto &e : dir.entries) {
+                if (!e.have_st) continue;
+                const char *key = relative_path(e.path.c_str());
+                // Keep the verdicts of the views walked before this one
+                if (views.size() > 1 && attr_cache.get(key, cached) && cached.generation == fs.generation
+                        && !cached.err) {
+                    entry.judged = cached.judged | view_bit;
+                    entry.hidden = (cached.hidden & ~view_bit) | (e.hide ? view_bit : 0);
+                } else {
+                    entry.judged = view_bit;
+                    entry.hidden = e.hide ? view_bit : 0;
+                }
+                entry.branch = e.branch;
+                entry.st = e.st;
+                attr_cache.put(key, entry);
+            }
+        }
+        paths.fetch_add(dir.entries.size(), std::memory_order_relaxed);
+    });
 
-    regfree(regex);
+    std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    log_msg(LOG_INFO, "%s: Prewarmed %zu paths with %u threads in %.1f seconds",
+            PACKAGE_STRING, paths.load(), walk_threads(), took.count());
 }
 
-std::vector<std::string> split(const std::string &s, char delim) {
-    std::vector<std::string> result;
-    std::stringstream ss (s);
-    std::string item;
-
-    while (getline (ss, item, delim)) {
-        result.push_back (item);
+/** Remove write permissions = chmod a-w, unless told to preserve them */
+static void strip_write_perms(struct stat *st_data) {
+    if (!conf.preserve_perms) {
+      st_data->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
     }
-
-    return result;
 }
 
-/** Read the RegEx configuration file */
-static int read_config(const std::filesystem::path &conf_file) {
-    int regcomp_res;
-    std::stringstream full_pattern;   //< Buffer to store the merged patterns
+/** Decide whether the kernel may keep the pages it cached for a file from an
+ * earlier open, according to the keep_cache option.
+ *
+ * @param fd The newly opened source file. */
+static bool keep_page_cache(const std::string &path, int fd) {
+    if (conf.keep_cache != KEEP_CACHE_MTIME) return conf.keep_cache == KEEP_CACHE_ALWAYS;
 
-    // File types we want to ignore
-    regex_t type_pattern;
-    regcomp_res = regcomp(&type_pattern, "^\\|\\s*type:\\s*(CHR|BLK|FIFO|LNK|SOCK)\\s*$", REG_EXTENDED);
-    if (regcomp_res) {
-        log_msg(LOG_ERR, "Failed compiling config parser regex.");
-        return -3;
-    }
-    scope_guard free_type_pattern = [&](){ regfree(&type_pattern); };
+    struct stat st;
+    if (fstat(fd, &st)) return false;
 
-    // Config file lines we want to ignore
-    regex_t ignore_pattern;
-    regcomp_res = regcomp(&ignore_pattern, "^#|^\\s*$",
-                    REG_EXTENDED | REG_NOSUB);
-    if (regcomp_res) {
-        log_msg(LOG_ERR, "Failed compiling config parser regex.");
-        regfree(&type_pattern);
-        return -3;
-    }
-    scope_guard free_ignore_pattern = [&](){ regfree(&ignore_pattern); };
+    open_stamp last, now = { st.st_mtim, st.st_size };
+    bool same = open_stamps.get(path, last) && same_mtime(last.mtime, now.mtime) && last.size == now.size;
+    if (!same) open_stamps.put(path, now);
+    return same;
+}
 
-    std::ifstream input(conf_file);
-    if (input.fail()) {
-        log_msg(LOG_ERR, "Failed to open config file: %s", conf_file.c_str());
-        return -1;
+/** Pick how the kernel caches a newly opened file. The |io: lines of the
+ * config file come first, then the keep_cache option. */
+static void set_cache_policy(const std::string &path, int fd, struct fuse_file_info *fi) {
+    filter_ref all;
+    const char *view_path = path.c_str();
+    const filter_set *fs = view_filters(*all, view_path);
+    if (fs == NULL) fs = &*all;
+
+    fi->direct_io = fs->direct_io && fs->direct_io->match(view_path);
+    if (fi->direct_io) {
+        fi->keep_cache = 0;
+    } else if (fs->keep_cache && fs->keep_cache->match(view_path)) {
+        fi->keep_cache = 1;
+    } else {
+        fi->keep_cache = keep_page_cache(path, fd);
     }
-    scope_guard close_file = [&](){ input.close(); };
-
-    std::string line;
-    while (std::getline(input, line)) {
-        // Ignore comments or empty lines in the config file
-        if (line.empty()) continue;
-        if (! regexec(&ignore_pattern, line.c_str(), 0, NULL, 0)) continue;
+}
 
-        if (line[line.size() - 1] == '\n') {
-            line = line.substr(0, line.size() - 1);
-        }
+/** What fi->fh points to for an open file */
+struct open_file {
+    explicit open_file(int fd) : fd(fd), backing_id(0), next_offset(0), prefetched_to(0), sequential(false) {}
 
-        regmatch_t match[2];
-        if (! regexec(&type_pattern, line.c_str(), sizeof(match) / sizeof(*match), match, 0)) {
-            log_msg(LOG_DEBUG, "Type: %s", line.c_str() + 5);
-            if (strncmp(line.c_str() + match[1].rm_so, "CHR", 3) == 0) {
-                modes.emplace(S_IFCHR & S_IFMT);
-            } else if (strncmp(line.c_str() + match[1].rm_so, "BLK", 3) == 0) {
-                modes.emplace(S_IFBLK & S_IFMT);
-            } else if (strncmp(line.c_str() + match[1].rm_so, "LNK", 3) == 0) {
-                modes.emplace(S_IFLNK & S_IFMT);
-            } else if (strncmp(line.c_str() + match[1].rm_so, "FIFO", 4) == 0) {
-                modes.emplace(S_IFIFO & S_IFMT);
-            } else if (strncmp(line.c_str() + match[1].rm_so, "SOCK", 4) == 0) {
-                modes.emplace(S_IFSOCK & S_IFMT);
-            }
-            continue;
-        }
+    int fd;
+    int backing_id;     //< Set if the kernel reads from fd itself (passthrough option)
 
-        static const std::string prefix("|extensionPriority:");
-        if (line.find(prefix) == 0) {
-            auto extensions = split(line.substr(prefix.size()), ',');
-            if (extensions.empty()) continue;
+    // For the readahead_kb option. Reads on one handle may run concurrently,
+    // but this is only a guess at the access pattern, so they don't have to
+    // agree on it.
+    std::atomic<off_t> next_offset;     //< Where the previous read ended
+    std::atomic<off_t> prefetched_to;   //< End of the last window handed to the kernel
+    std::atomic<bool> sequential;       //< POSIX_FADV_SEQUENTIAL was given
+};
 
-            static const std::string dot(".");
-            for (auto it = extensions.crbegin(); it != extensions.crend(); ++it) {
-                for (auto it2 = it + 1; it2 != extensions.crend(); ++it2) {
-                    log_msg(LOG_DEBUG, "%s overrides %s", it2->c_str(), it->c_str());
-                    extPriority.emplace(std::make_pair(dot + *it, dot + *it2));
-                }
-            }
-            continue;
-        }
+/** Ask the source file system to fetch the next readahead_kb of a file that
+ * is being read sequentially, before the reader gets there. */
+static void prefetch(open_file *file, off_t offset, size_t size) {
+    if (conf.readahead_kb == 0) return;
 
-        // Test if standalone regex compiles before concatenating.
-        regcomp_res = regcomp(&pattern, line.c_str(), REG_EXTENDED | REG_NOSUB);
-        if (regcomp_res) {
-            // This one failed, we verbosely ignore it.
-            log_regex_error(regcomp_res, &pattern, line.c_str());
-        } else {
-            regfree(&pattern);
-            log_msg(LOG_DEBUG, "Pattern: %s", line.c_str());
-            
-            // Add regex to the buffer
-            if (full_pattern.rdbuf()->in_avail()) {
-                full_pattern << "|(" << line << ")";
-            } else {
-                full_pattern << "(" << line << ")";
-            }
-        }
-    }
+    const off_t end = offset + size;
+    const off_t last_end = file->next_offset.exchange(end, std::memory_order_relaxed);
 
-    std::string pattern_str = full_pattern.str();
-    if (pattern_str.empty() && extPriority.empty() && modes.empty()) {
-        log_msg(LOG_ERR, "Config file contains no valid pattern.");
-        return -1;
-    }
+    // The kernel splits and reorders reads a little, so allow for some slack
+    if (offset > last_end + (off_t)size || offset + (off_t)size < last_end) return;
 
-    if (pattern_str.empty()) {
-        hasPattern = false;
-    } else {
-        hasPattern = true;
-        regcomp_res = regcomp(&pattern, pattern_str.c_str(), REG_EXTENDED | REG_NOSUB);
-        if ( regcomp_res ) {
-            log_regex_error(regcomp_res, &pattern, pattern_str.c_str());
-            return -1;
-        }
+    if (!file->sequential.exchange(true, std::memory_order_relaxed)) {
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
     }
 
-    log_msg(LOG_DEBUG, "Full regex: %s", pattern_str.c_str());
+    // Move the window along once the reader is half way through it
+    const off_t window = (off_t)conf.readahead_kb * 1024;
+    const off_t prefetched_to = file->prefetched_to.load(std::memory_order_relaxed);
+    if (prefetched_to - end > window / 2) return;
 
-    return 0;
-}
-
-/** If the file name matches one of the RegEx patterns, hide it. */
-static int should_hide(const char *name, mode_t mode) {
-    mode &= S_IFMT;
-    log_msg(LOG_DEBUG, "should_hide test: %07o %s", mode, name);
-
-    if (!conf.invert && !extPriority.empty()) {
-        auto fname = translate_path(name);
-        auto ext = fname.extension();
-        auto range = extPriority.equal_range(ext.string());
-        for (auto it = range.first; it != range.second; ++it) {
-            fname.replace_extension(it->second);
-            if (std::filesystem::exists(fname)) {
-                return true;
-            }
-        }
-    }
-
-    for (const auto &m : modes) {
-        if (mode == m) {
-            log_msg(LOG_DEBUG, "type: %07o %s", mode, name);
-            return !conf.invert;
-        }
-    }
-    if (conf.invert && mode != S_IFREG && mode != S_IFDIR)
-        return conf.invert;
-    if (hasPattern && !regexec(&pattern, name, 0, NULL, 0)) {
-        // We have a match.
-        log_msg(LOG_DEBUG, "match: %s", name);
-        return !conf.invert;
-    }
-    return conf.invert;
+    const off_t from = std::max(end, prefetched_to);
+    file->prefetched_to.store(end + window, std::memory_order_relaxed);
+    posix_fadvise(file->fd, from, end + window - from, POSIX_FADV_WILLNEED);
+    metric_add(METRIC_PREFETCHED_BYTES, end + window - from);
 }
 
 /******************************
@@ -364,84 +426,242 @@ static int should_hide(const char *name, mode_t mode) {
  *
  ******************************/
 
-static int callback_getattr(const char *path, struct stat *st_data) {
-    auto trpath = translate_path(path);
-    log_msg(LOG_DEBUG, "%s(%s, %s)", __PRETTY_FUNCTION__, path, trpath.c_str());
+static int callback_fgetattr(const char *path, struct stat *st_data, struct fuse_file_info *finfo) {
+    log_debug("%s(%s)", __PRETTY_FUNCTION__, path);
+    op_timer timer(OP_GETATTR, path);
 
-    if (lstat(trpath.c_str(), st_data)) return -errno;
+    if (fstat(((open_file *)finfo->fh)->fd, st_data)) return -errno;
 
-    if (should_hide(path, st_data->st_mode)) return -ENOENT;
+    strip_write_perms(st_data);
+    return 0;
+}
+
+#if HAVE_FUSE3
+static int callback_getattr(const char *path, struct stat *st_data, struct fuse_file_info *finfo) {
+    // FUSE 3 folds fgetattr into getattr
+    if (finfo) return callback_fgetattr(path, st_data, finfo);
+#else
+static int callback_getattr(const char *path, struct stat *st_data) {
+#endif
+    log_debug("%s(%s)", __PRETTY_FUNCTION__, path);
+    op_timer timer(OP_GETATTR, path);
 
+    int hide;
+    int res = get_attr(path, st_data, &hide);
+    if (res) return res;
+    if (hide) return -ENOENT;
 
-    // Remove write permissions = chmod a-w
-    if (!conf.preserve_perms) {
-      st_data->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
-    }
+    strip_write_perms(st_data);
     return 0;
 }
 
 static int callback_readlink(const char *path, char *buf, size_t size) {
-    auto trpath = translate_path(path);
-    log_msg(LOG_DEBUG, "%s(%s, %s)", __PRETTY_FUNCTION__, path, trpath.c_str());
+    log_debug("%s(%s)", __PRETTY_FUNCTION__, path);
+    op_timer timer(OP_READLINK, path);
 
     if (should_hide(path, S_IFLNK)) return -ENOENT;
 
-    int res = readlink(trpath.c_str(), buf, size - 1);
+    int res = readlinkat(source_fd(relative_path(path)), relative_path(path), buf, size - 1);
     if (res == -1) return -errno;
 
     buf[res] = '\0';
     return 0;
 }
 
-static int callback_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                            off_t offset, struct fuse_file_info *fi)
-{
-    log_msg(LOG_DEBUG, "%s(%s)", __PRETTY_FUNCTION__, path);
-    if (should_hide(path, S_IFREG)) return -ENOENT;
+/** A directory listing, read and filtered once by callback_opendir() and then
+ * handed out by callback_readdir() in as many pieces as libfuse asks for. The
+ * names are kept together in a single buffer. */
+struct dir_handle {
+    struct entry {
+        uint32_t name;  //< Where the name starts in "names"
+        ino_t ino;
+        mode_t mode;    //< Only the file type bits
+        unsigned branch;    //< The source branch it was read from
+    };
+
+    std::vector<entry> entries;
+    std::vector<char> names;    //< NUL-terminated, one after the other
+    bool served;        //< Set once readdir() has returned some of the entries
+
+    const char *name(const entry &e) const { return names.data() + e.name; }
+
+    void clear() {
+        entries.clear();
+        names.clear();
+    }
 
-    DIR *dp;
-    struct dirent *de;
+    void add(const char *name, ino_t ino, mode_t mode, unsigned branch) {
+        entries.push_back({ (uint32_t)names.size(), ino, mode, branch });
+        names.insert(names.end(), name, name + strlen(name) + 1);
+    }
+};
 
-    (void) offset;
-    (void) fi;
+/** Read a source directory (all of its branches) and keep the entries that
+ * should be visible. With views, the root lists the views instead. */
+static int list_dir(const filter_set &fs, const char *path, dir_handle &visible) {
+    visible.clear();
+    const char *view_path;
+    if (path_view(path, &view_path) < 0) {
+        visible.add(".", 0, S_IFDIR, 0);
+        visible.add("..", 0, S_IFDIR, 0);
+        for (const auto &view : views) visible.add(view.name.c_str(), 0, S_IFDIR, 0);
+        return 0;
+    }
 
-    auto trpath = translate_path(path);
+    // Read the whole directory first, so extensionPriority can be resolved
+    // from the listing itself.
+    source_dir source;
+    int res = source.open(relative_path(path));
+    if (res) return res;
+    source.resolve_types(path);
+
+    auto index = new_dir_index(source.stat());
+    if (!fs.extPriority.empty()) {
+        for (size_t i = 0; i < source.size(); i++) {
+            dir_index_add(fs, *index, source.name(i), source.type(i));
+        }
+        cache_dir_index(fs, view_path, index);
+    }
 
-    dp = opendir(trpath.c_str());
-    if (dp == NULL) return -errno;
+    static thread_local std::string fullPath;
+    fullPath.assign(path);
+    if (fullPath.back() != '/') fullPath += '/';
+    const size_t dir_len = fullPath.size();
 
-    while((de = readdir(dp)) != NULL) {
-        auto fullPath = std::filesystem::path(path) / de->d_name;
+    visible.entries.reserve(source.size());
+    for (size_t i = 0; i < source.size(); i++) {
+        fullPath.resize(dir_len);
+        fullPath += source.name(i);
 
-        int stmode = DTTOIF(de->d_type);
+        mode_t stmode = DTTOIF(source.type(i));
+        if (!should_hide(fs, fullPath.c_str(), stmode, index.get())) {
+            visible.add(source.name(i), source.ino(i), stmode, source.branch(i));
+        }
+    }
 
-        if (stmode == DT_UNKNOWN) {
-            struct stat stdata;
-            trpath = translate_path(fullPath);
-            if (lstat(trpath.c_str(), &stdata)) {
-                log_msg(LOG_ERR, "%s: unexpected lstat() error %d for %s", PACKAGE_STRING, errno, fullPath.c_str());
-                stmode = 0;
-            } else {
-                stmode = stdata.st_mode;
-            }
+    return 0;
+}
+
+#if HAVE_FUSE3
+/** How many directory entries readdirplus stats at a time */
+static const size_t stat_batch_size = 32;
+
+/** Stat "count" (at most stat_batch_size) entries of a listing, relative to
+ * the directory in the branch each one was read from. With io_uring the calls
+ * are submitted together instead of being made one after the other.
+ *
+ * @param dir_fds The directory in each branch, as source_dir::fds() has them
+ * @param handle The listing "entries" are part of, which has their names
+ * @param st Receives the attributes of each entry
+ * @param ok Set for the entries that could be stat()ed */
+static void stat_entries(const int *dir_fds, const dir_handle &handle, const dir_handle::entry *entries, size_t count,
+                         struct stat *st, bool *ok) {
+    assert(count <= stat_batch_size);
+#if HAVE_LIBURING
+    struct statx stx[stat_batch_size];
+    int res[stat_batch_size];
+    if (uring.run_all(count, [&](io_uring_sqe *sqe, size_t i) {
+            io_uring_prep_statx(sqe, dir_fds[entries[i].branch], handle.name(entries[i]), AT_SYMLINK_NOFOLLOW,
+                                STATX_BASIC_STATS, &stx[i]);
+        }, res)) {
+        for (size_t i = 0; i < count; i++) {
+            ok[i] = res[i] == 0;
+            if (ok[i]) statx_to_stat(stx[i], &st[i]);
         }
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++) {
+        ok[i] = fstatat(dir_fds[entries[i].branch], handle.name(entries[i]), &st[i], AT_SYMLINK_NOFOLLOW) == 0;
+    }
+}
+#endif
 
-        int hide = should_hide(fullPath.c_str(), stmode);
+static int callback_opendir(const char *path, struct fuse_file_info *fi) {
+    log_debug("%s(%s)", __PRETTY_FUNCTION__, path);
+    op_timer timer(OP_OPENDIR, path);
+    filter_ref fs;
+    if (should_hide(*fs, path, S_IFDIR)) return -ENOENT;
 
-        if (hide) {
-            // hide some files and directories
-        } else {
-            struct stat st;
-            memset(&st, 0, sizeof(st));
-            st.st_ino = de->d_ino;
-            st.st_mode = de->d_type << 12;
-            if (filler(buf, de->d_name, &st, 0))
-                break;
+    std::unique_ptr<dir_handle> handle(new dir_handle());
+    handle->served = false;
+    int res = list_dir(*fs, path, *handle);
+    if (res) return res;
+
+    fi->fh = (uint64_t)handle.release();
+    return 0;
+}
+
+/** Hand out the entries starting at "offset". The offset of an entry is its
+ * index in the listing plus one, so a listing that doesn't fit in one buffer
+ * is resumed where it left off instead of being read and filtered again. */
+#if HAVE_FUSE3
+static int callback_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                            off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+#else
+static int callback_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                            off_t offset, struct fuse_file_info *fi)
+#endif
+{
+    log_debug("%s(%s, %lld)", __PRETTY_FUNCTION__, path, (long long)offset);
+    op_timer timer(OP_READDIR, path, offset);
+    dir_handle *handle = (dir_handle *)fi->fh;
+
+    // Starting over (rewinddir) should show the current contents
+    if (offset == 0 && handle->served) {
+        filter_ref fs;
+        int res = list_dir(*fs, path, *handle);
+        if (res) return res;
+    }
+    handle->served = true;
+
+#if HAVE_FUSE3
+    // For readdirplus the kernel wants the attributes of every entry as well,
+    // which spares it the getattr() it would otherwise send for each one. The
+    // views in the root aren't in the source to be stat()ed there.
+    source_dir plus_dir;
+    const bool plus = (flags & FUSE_READDIR_PLUS) && path_view(path) >= 0
+        && plus_dir.open(relative_path(path), false) == 0;
+#endif
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+#if HAVE_FUSE3
+    struct stat plus_st[stat_batch_size];
+    bool have_plus_st[stat_batch_size];
+#endif
+    for (size_t i = offset; i < handle->entries.size(); i++) {
+        const auto &entry = handle->entries[i];
+        st.st_ino = entry.ino;
+        st.st_mode = entry.mode;
+#if HAVE_FUSE3
+        const size_t slot = (i - offset) % stat_batch_size;
+        if (plus && slot == 0) {
+            stat_entries(plus_dir.fds(), *handle, &entry, std::min(stat_batch_size, handle->entries.size() - i),
+                         plus_st, have_plus_st);
         }
 
+        enum fuse_fill_dir_flags fill_flags = FUSE_FILL_DIR_DEFAULTS;
+        const struct stat *fill_st = &st;
+        if (plus && have_plus_st[slot]) {
+            strip_write_perms(&plus_st[slot]);
+            fill_st = &plus_st[slot];
+            fill_flags = FUSE_FILL_DIR_PLUS;
+        }
+        if (filler(buf, handle->name(entry), fill_st, i + 1, fill_flags))
+            break;
+#else
+        if (filler(buf, handle->name(entry), &st, i + 1))
+            break;
+#endif
     }
 
-    closedir(dp);
+    return 0;
+}
+
+static int callback_releasedir(const char *path, struct fuse_file_info *fi) {
+    (void) path;
+    delete (dir_handle *)fi->fh;
     return 0;
 }
 
@@ -475,7 +695,12 @@ static int callback_symlink(const char *from, const char *to)
     return -EPERM;
 }
 
+#if HAVE_FUSE3
+static int callback_rename(const char *from, const char *to, unsigned int flags) {
+    (void)flags;
+#else
 static int callback_rename(const char *from, const char *to) {
+#endif
     if (should_hide(from, S_IFREG)) return -ENOENT;
 
     (void)from;
@@ -491,7 +716,12 @@ static int callback_link(const char *from, const char *to) {
     return -EPERM;
 }
 
+#if HAVE_FUSE3
+static int callback_chmod(const char *path, mode_t mode, struct fuse_file_info *finfo) {
+    (void)finfo;
+#else
 static int callback_chmod(const char *path, mode_t mode) {
+#endif
     if (should_hide(path, S_IFREG)) return -ENOENT;
 
     (void)path;
@@ -499,7 +729,12 @@ static int callback_chmod(const char *path, mode_t mode) {
     return -EPERM;
 }
 
+#if HAVE_FUSE3
+static int callback_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *finfo) {
+    (void)finfo;
+#else
 static int callback_chown(const char *path, uid_t uid, gid_t gid) {
+#endif
     if (should_hide(path, S_IFREG)) return -ENOENT;
 
     (void)path;
@@ -508,7 +743,12 @@ static int callback_chown(const char *path, uid_t uid, gid_t gid) {
     return -EPERM;
 }
 
+#if HAVE_FUSE3
+static int callback_truncate(const char *path, off_t size, struct fuse_file_info *finfo) {
+    (void)finfo;
+#else
 static int callback_truncate(const char *path, off_t size) {
+#endif
     if (should_hide(path, S_IFREG)) return -ENOENT;
 
     (void)path;
@@ -516,24 +756,37 @@ static int callback_truncate(const char *path, off_t size) {
     return -EPERM;
 }
 
+#if HAVE_FUSE3
+static int callback_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *finfo)
+{
+    (void)path;
+    (void)tv;
+    (void)finfo;
+    return -EPERM;
+}
+#else
 static int callback_utime(const char *path, struct utimbuf *buf)
 {
     (void)path;
     (void)buf;
     return -EPERM;
 }
+#endif
 
-/** This function should just check if the operation is permitted for the given
- * flags. FUSE will provide its own file descriptor to the calling
- * application.
+/** Check if the operation is permitted for the given flags and, if so, keep
+ * the underlying file open for the lifetime of the FUSE file handle. The
+ * filtering rules are applied once, here. Subsequent read() calls go straight
+ * to the file descriptor stored in finfo->fh.
  */
 static int callback_open(const char *path, struct fuse_file_info *finfo) {
-    auto trpath = translate_path(path);
-    log_msg(LOG_DEBUG, "%s(%s, %s)", __PRETTY_FUNCTION__, path, trpath.c_str());
+    log_debug("%s(%s)", __PRETTY_FUNCTION__, path);
+    op_timer timer(OP_OPEN, path, finfo->flags);
 
-    struct stat st;
-    if (lstat(trpath.c_str(), &st)) return -errno;
-    if (should_hide(path, st.st_mode)) return -ENOENT;
+    int hide;
+    unsigned branch;
+    int res = get_attr(path, NULL, &hide, &branch);
+    if (res) return res;
+    if (hide) return -ENOENT;
 
     /* We allow opens, unless they're tring to write, sneaky
      * people.
@@ -544,35 +797,51 @@ static int callback_open(const char *path, struct fuse_file_info *finfo) {
         return -EPERM;
     }
 
-    int res = open(trpath.c_str(), flags);
+    res = openat(branches[branch].fd, relative_path(path), flags);
     if (res == -1) return -errno;
 
-    close(res);
+    finfo->fh = (uint64_t)new open_file(res);
+    set_cache_policy(path, res, finfo);
     return 0;
 }
 
 static int callback_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *finfo) {
-    (void)finfo;
-    auto trpath = translate_path(path);
-    log_msg(LOG_DEBUG, "%s(%s, %s)", __PRETTY_FUNCTION__, path, trpath.c_str());
+    op_timer timer(OP_READ, path, offset, size);
+    open_file *file = (open_file *)finfo->fh;
 
-    struct stat st;
-    if (lstat(trpath.c_str(), &st)) return -errno;
+    prefetch(file, offset, size);
+    int res = pread(file->fd, buf, size, offset);
+    if (res == -1) res = -errno;
+    else metric_add(METRIC_READ_BYTES, res);
 
-    if (should_hide(path, st.st_mode)) return -ENOENT;
+    return res;
+}
 
+#if !USE_LOWLEVEL
+/** Zero-copy variant of callback_read, used when the splice_read option is
+ * given. Instead of copying the data into a buffer we own, hand libfuse a
+ * buffer that refers to the source file descriptor so it can splice() the
+ * data straight into /dev/fuse. */
+static int callback_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *finfo) {
+    op_timer timer(OP_READ, path, offset, size);
+    open_file *file = (open_file *)finfo->fh;
 
-    errno = 0;
-    int fd = open(trpath.c_str(), O_RDONLY);
-    if (fd == -1) return -errno;
+    prefetch(file, offset, size);
+    metric_add(METRIC_READ_BYTES, size);
 
-    errno = 0;
-    int res = pread(fd, buf, size, offset);
-    if (res == -1) res = -errno;
+    // libfuse releases this with free()
+    struct fuse_bufvec *src = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+    if (src == NULL) return -ENOMEM;
 
-    close(fd);
-    return res;
+    *src = FUSE_BUFVEC_INIT(size);
+    src->buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    src->buf[0].fd = file->fd;
+    src->buf[0].pos = offset;
+
+    *bufp = src;
+    return 0;
 }
+#endif
 
 static int callback_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *finfo) {
     (void)buf;
@@ -580,27 +849,42 @@ static int callback_write(const char *path, const char *buf, size_t size, off_t
     (void)offset;
     (void)finfo;
 
-    auto trpath = translate_path(path);
-    log_msg(LOG_DEBUG, "%s(%s, %s)", __PRETTY_FUNCTION__, path, trpath.c_str());
+    log_debug("%s(%s)", __PRETTY_FUNCTION__, path);
 
-    struct stat st;
-    if (lstat(trpath.c_str(), &st)) return -errno;
-
-    if (should_hide(path, st.st_mode)) return -ENOENT;
+    int hide;
+    int res = get_attr(path, NULL, &hide);
+    if (res) return res;
+    if (hide) return -ENOENT;
 
     return -EPERM;
 }
 
 static int callback_statfs(const char *path, struct statvfs *st_buf) {
-    auto trpath = translate_path(path);
-    log_msg(LOG_DEBUG, "%s(%s, %s)", __PRETTY_FUNCTION__, path, trpath.c_str());
+    log_debug("%s(%s)", __PRETTY_FUNCTION__, path);
+    op_timer timer(OP_STATFS, path);
 
-    struct stat st;
-    if (lstat(trpath.c_str(), &st)) return -errno;
+    int hide;
+    int res = get_attr(path, NULL, &hide);
+    if (res) return res;
+    if (hide) return -ENOENT;
+
+    int fd = openat(source_fd(relative_path(path)), relative_path(path), O_PATH_OR_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -errno;
 
-    if (should_hide(path, st.st_mode)) return -ENOENT;
+    res = fstatvfs(fd, st_buf);
+    if (res == -1) res = -errno;
 
-    int res = statvfs(trpath.c_str(), st_buf);
+    close(fd);
+    return res;
+}
+
+static int callback_flush(const char *path, struct fuse_file_info *finfo) {
+    (void) path;
+
+    /* Called on each close() of a duplicated descriptor. Closing a dup of our
+     * own fd reports any deferred errors from the underlying file system
+     * without giving up the descriptor we still need for read(). */
+    int res = close(dup(((open_file *)finfo->fh)->fd));
     if (res == -1) return -errno;
 
     return 0;
@@ -608,7 +892,9 @@ static int callback_statfs(const char *path, struct statvfs *st_buf) {
 
 static int callback_release(const char *path, struct fuse_file_info *finfo) {
     (void) path;
-    (void) finfo;
+    open_file *file = (open_file *)finfo->fh;
+    close(file->fd);
+    delete file;
     return 0;
 }
 
@@ -620,18 +906,18 @@ static int callback_fsync(const char *path, int crap, struct fuse_file_info *fin
 }
 
 static int callback_access(const char *path, int mode) {
-    auto trpath = translate_path(path);
-    log_msg(LOG_DEBUG, "%s(%s, %s)", __PRETTY_FUNCTION__, path, trpath.c_str());
-
-    struct stat st;
-    if (lstat(trpath.c_str(), &st)) return -errno;
+    log_debug("%s(%s)", __PRETTY_FUNCTION__, path);
+    op_timer timer(OP_ACCESS, path, mode);
 
-    if (should_hide(path, st.st_mode)) return -ENOENT;
+    int hide;
+    int res = get_attr(path, NULL, &hide);
+    if (res) return res;
+    if (hide) return -ENOENT;
 
     if (mode & W_OK) return -1; // We are ReadOnly
 
     errno = 0;
-    int res = access(trpath.c_str(), mode);
+    res = faccessat(source_fd(relative_path(path)), relative_path(path), mode, 0);
     if (res == -1 && errno != 0) return -errno;
 
     return res;
@@ -651,17 +937,21 @@ static int callback_setxattr(const char *path, const char *name, const char *val
 }
 
 /**
- * Get the value of an extended attribute.
+ * Get the value of an extended attribute. The metrics option adds one to the
+ * root of the mount.
  */
 static int callback_getxattr(const char *path, const char *name, char *value, size_t size) {
-    auto trpath = translate_path(path);
-
-    struct stat st;
-    if (lstat(trpath.c_str(), &st)) return -errno;
-
-    if (should_hide(path, st.st_mode)) return -ENOENT;
+    op_timer timer(OP_GETXATTR, path, 0, size);
+    int hide;
+    int res = get_attr(path, NULL, &hide);
+    if (res) return res;
+    if (hide) return -ENOENT;
+
+    if (conf.metrics && strcmp(path, "/") == 0 && strcmp(name, metrics_xattr) == 0) {
+        return metrics_xattr_value(value, size);
+    }
 
-    int res = lgetxattr(trpath.c_str(), name, value, size);
+    res = lgetxattr(translate_path(path), name, value, size);
     if (res == -1) return -errno;
 
     return res;
@@ -671,14 +961,13 @@ static int callback_getxattr(const char *path, const char *name, char *value, si
  * List the supported extended attributes.
  */
 static int callback_listxattr(const char *path, char *list, size_t size) {
-    auto trpath = translate_path(path);
+    op_timer timer(OP_LISTXATTR, path, 0, size);
+    int hide;
+    int res = get_attr(path, NULL, &hide);
+    if (res) return res;
+    if (hide) return -ENOENT;
 
-    struct stat st;
-    if (lstat(trpath.c_str(), &st)) return -errno;
-
-    if (should_hide(path, st.st_mode)) return -ENOENT;
-
-    int res = llistxattr(trpath.c_str(), list, size);
+    res = llistxattr(translate_path(path), list, size);
     if(res == -1) return -errno;
 
     return res;
@@ -695,6 +984,209 @@ static int callback_removexattr(const char *path, const char *name) {
     return -EPERM;
 }
 
+/******************************
+ *
+ * Reloading the config file
+ *
+ ******************************/
+
+static int reload_pipe[2] = { -1, -1 };     //< Wakes up the reload thread
+static std::thread reload_thread;
+
+/** The config files the rules are read from: the config option's, or one per
+ * view */
+static std::vector<std::string> config_files() {
+    std::vector<std::string> files;
+    for (const auto &view : views) files.push_back(view.config);
+    if (files.empty()) files.push_back(conf.config);
+    return files;
+}
+
+/** Re-read the config files and swap the new rules in. If one of them has
+ * errors, the rules currently in effect are kept. */
+static void reload_config() {
+    std::string files;
+    for (const auto &file : config_files()) files += (files.empty() ? "" : ", ") + file;
+    log_msg(LOG_INFO, "%s: Reloading config file: %s", PACKAGE_STRING, files.c_str());
+
+    auto fs = std::make_shared<filter_set>();
+    std::string failed;
+    if (read_filters(*fs, failed)) {
+        log_msg(LOG_ERR, "%s: Error parsing config file: %s. Keeping the previous rules.",
+                PACKAGE_STRING, failed.c_str());
+        return;
+    }
+    publish_filters(fs);
+
+    // The index was built with the old rules, so its verdicts are ignored now
+    start_index_thread();
+
+    // Results computed with the old rules are ignored anyway because of their
+    // generation, this only frees them up sooner.
+    attr_cache.clear();
+    dir_index_cache.clear();
+}
+
+static void sighup_handler(int sig) {
+    (void) sig;
+    int saved_errno = errno;
+    if (write(reload_pipe[1], "r", 1) == -1) {
+        // The pipe is full, so a reload is already pending
+    }
+    errno = saved_errno;
+}
+
+/** Wait for SIGHUP (or a change to the config file, with the watch_config
+ * option) and reload the config, until asked to quit. */
+static void reload_loop() {
+    struct pollfd fds[2];
+    nfds_t nfds = 1;
+    fds[0].fd = reload_pipe[0];
+    fds[0].events = POLLIN;
+
+#if HAVE_SYS_INOTIFY_H
+    // Watch the directories rather than the files, since editors usually
+    // write a new file and rename it over the old one.
+    std::unordered_map<int, std::unordered_set<std::string>> watched;  //< Watch -> config file names
+    int inotify_fd = -1;
+    if (conf.watch_config) {
+        inotify_fd = inotify_init1(IN_CLOEXEC);
+        for (const auto &file : config_files()) {
+            std::filesystem::path config(file);
+            int wd = inotify_fd == -1 ? -1 : inotify_add_watch(inotify_fd, config.parent_path().c_str(),
+                    IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (wd == -1) {
+                log_msg(LOG_ERR, "%s: Can not watch config file %s for changes: %s",
+                        PACKAGE_STRING, file.c_str(), strerror(errno));
+            } else {
+                watched[wd].insert(config.filename());
+            }
+        }
+        if (!watched.empty()) {
+            fds[1].fd = inotify_fd;
+            fds[1].events = POLLIN;
+            nfds = 2;
+        }
+    }
+    scope_guard close_inotify = [&](){ if (inotify_fd != -1) close(inotify_fd); };
+#endif
+
+    for (;;) {
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR) continue;
+            log_msg(LOG_ERR, "%s: poll() error %d in reload thread", PACKAGE_STRING, errno);
+            return;
+        }
+
+        bool reload = false;
+        if (fds[0].revents) {
+            char cmd[64];
+            ssize_t len = read(reload_pipe[0], cmd, sizeof(cmd));
+            if (len <= 0 || memchr(cmd, 'q', len)) return;
+            reload = true;
+        }
+
+#if HAVE_SYS_INOTIFY_H
+        if (nfds > 1 && fds[1].revents) {
+            char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+            ssize_t len = read(inotify_fd, events, sizeof(events));
+            for (char *ptr = events; len > 0 && ptr < events + len; ) {
+                const struct inotify_event *event = (const struct inotify_event *)ptr;
+                if (event->len && watched[event->wd].count(event->name)) reload = true;
+                ptr += sizeof(struct inotify_event) + event->len;
+            }
+        }
+#endif
+
+        if (reload) reload_config();
+    }
+}
+
+/** Called once the file system is mounted (and daemonized, so threads started
+ * here survive). */
+#if HAVE_FUSE3
+static void *callback_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    // The kernel timeouts, unless called by ll_init() which has no config
+    if (cfg) {
+        if (conf.entry_timeout >= 0) cfg->entry_timeout = conf.entry_timeout;
+        if (conf.attr_timeout >= 0) cfg->attr_timeout = conf.attr_timeout;
+        if (conf.negative_timeout >= 0) cfg->negative_timeout = conf.negative_timeout;
+    }
+#else
+static void *callback_init(struct fuse_conn_info *conn) {
+#endif
+    (void) conn;
+
+#if HAVE_FUSE3
+    // FUSE 3 has no splice_read mount option, the data is spliced on its way
+    // back to the kernel once it's asked for here
+    if (conf.splice_read) {
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    }
+#endif
+
+#ifdef FUSE_CAP_DIRECT_IO_ALLOW_MMAP
+    // Keep the direct_io files (|io:direct_io: lines) mmap()able
+    conn->want |= conn->capable & FUSE_CAP_DIRECT_IO_ALLOW_MMAP;
+#endif
+
+    start_log_thread();
+    start_index_thread();
+    start_metrics_thread();
+    start_trace_thread();
+
+#if HAVE_LIBURING
+    if (conf.uring_depth) {
+        int res = uring.start(conf.uring_depth, [](int err) {
+            log_msg(LOG_ERR, "%s: Waiting on io_uring failed (%s), the source will be accessed directly",
+                    PACKAGE_STRING, strerror(-err));
+        });
+        if (res) {
+            log_msg(LOG_WARNING, "%s: Can not set up io_uring (%s), the source will be accessed directly",
+                    PACKAGE_STRING, strerror(-res));
+        }
+    }
+#endif
+
+    if (pipe(reload_pipe) == 0) {
+        fcntl(reload_pipe[1], F_SETFL, O_NONBLOCK);
+
+        // Replaces the libfuse handler, which would unmount on SIGHUP
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = sighup_handler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGHUP, &sa, NULL);
+
+        reload_thread = std::thread(reload_loop);
+    } else {
+        log_msg(LOG_ERR, "%s: Can not create reload pipe, SIGHUP will not reload the config", PACKAGE_STRING);
+    }
+    return NULL;
+}
+
+static void callback_destroy(void *private_data) {
+    (void) private_data;
+
+    if (reload_thread.joinable()) {
+        signal(SIGHUP, SIG_IGN);
+        if (write(reload_pipe[1], "q", 1) == 1) {
+            reload_thread.join();
+        } else {
+            reload_thread.detach();
+        }
+    }
+
+    stop_index_thread();
+#if HAVE_LIBURING
+    uring.stop();
+#endif
+    stop_trace_thread();
+    stop_metrics_thread();
+    stop_log_thread();
+}
+
 // /usr/include/fuse/fuse_compat.h
 struct fuse_operations callback_oper = {
     .getattr    = callback_getattr,
@@ -710,12 +1202,14 @@ struct fuse_operations callback_oper = {
     .chmod      = callback_chmod,
     .chown      = callback_chown,
     .truncate   = callback_truncate,
+#if !HAVE_FUSE3
     .utime      = callback_utime,
+#endif
     .open       = callback_open,
     .read       = callback_read,
     .write      = callback_write,
     .statfs     = callback_statfs,
-    // .flush
+    .flush      = callback_flush,
     .release    = callback_release,
     .fsync      = callback_fsync,
     /* Extended attributes support for userland interaction */
@@ -724,26 +1218,707 @@ struct fuse_operations callback_oper = {
     .listxattr  = callback_listxattr,
     .removexattr= callback_removexattr,
 
-    // .opendir
+    .opendir    = callback_opendir,
     .readdir    = callback_readdir,
-    // .releasedir
+    .releasedir = callback_releasedir,
     // .fsyncdir
-    // .init
-    // .destroy
+    .init       = callback_init,
+    .destroy    = callback_destroy,
     .access     = callback_access,
     // .create
+#if HAVE_FUSE3
+    // .lock
+    .utimens    = callback_utimens,
+#else
     // .ftruncate
-    // .fgetattr
+    .fgetattr   = callback_fgetattr,
+#endif
+};
+
+#if USE_LOWLEVEL
+
+/******************************
+ *
+ * Low-level FUSE 3 backend
+ *
+ ******************************/
+
+/** A source file or directory the kernel has looked up. The kernel refers to
+ * it by its address (the fuse_ino_t) until it forgets all of its lookups, so
+ * the path is built once per lookup instead of by libfuse for every call, and
+ * the filter verdict is kept with the node. */
+struct ll_inode {
+    std::string path;       //< Mount-relative path, what the filter rules see
+    int fd;                 //< O_PATH descriptor of the source node
+    dev_t dev;
+    ino_t ino;
+    mode_t mode;            //< Only the file type bits
+    uint64_t nlookup;       //< Guarded by ll_inodes_lock
+    std::atomic<uint64_t> generation;   //< The filter_set "hidden" was computed with
+    std::atomic<bool> hidden;
 };
 
+static std::mutex ll_inodes_lock;
+static std::unordered_map<std::string, ll_inode *> ll_inodes;  //< Guarded by ll_inodes_lock
+static ll_inode ll_root;
+static double ll_entry_timeout = 1.0;   //< How long the kernel may cache names
+static double ll_attr_timeout = 1.0;    //< How long the kernel may cache attributes
+static double ll_negative_timeout;      //< How long the kernel may remember missing names
+static bool ll_passthrough;    //< The passthrough option was given and the kernel supports it
+
+static ll_inode *ll_node(fuse_ino_t ino) {
+    return ino == FUSE_ROOT_ID ? &ll_root : (ll_inode *)(uintptr_t)ino;
+}
+
+/** The mount-relative path of "name" in "dir", for the trace. Only valid
+ * until the next call from the same thread. */
+static const char *ll_trace_path(const ll_inode *dir, const char *name) {
+    static thread_local std::string path;
+    path.assign(dir == &ll_root ? "" : dir->path).append("/").append(name);
+    return path.c_str();
+}
+
+/** The should_hide() verdict of a node, only recomputed after a reload */
+static bool ll_hidden(ll_inode *node) {
+    filter_ref fs;
+    if (node->generation.load(std::memory_order_acquire) != fs->generation) {
+        node->hidden.store(should_hide(*fs, node->path.c_str(), node->mode), std::memory_order_relaxed);
+        node->generation.store(fs->generation, std::memory_order_release);
+    }
+    return node->hidden.load(std::memory_order_relaxed);
+}
+
+/** Look up "name" in "parent" and take a lookup reference on its node.
+ *
+ * With several branches, "name" may not be in the same branch as "parent", so
+ * it's looked up from the top of the branches instead. So are the views, which
+ * aren't in the root of the source.
+ *
+ * @param st The attributes of "name", if the caller already has them
+ * @param branch The branch "st" was read in
+ * @return 0, or the errno to reply with. */
+static int ll_lookup_node(ll_inode *parent, const char *name, struct fuse_entry_param *e,
+                          const struct stat *st = NULL, unsigned branch = 0) {
+    memset(e, 0, sizeof(*e));
+    e->attr_timeout = ll_attr_timeout;
+    e->entry_timeout = ll_entry_timeout;
+
+    std::string path(parent == &ll_root ? "" : parent->path);
+    path += '/';
+    path += name;
+
+    const bool from_top = branches.size() > 1 || (parent == &ll_root && !views.empty());
+    if (st) {
+        e->attr = *st;
+    } else if (from_top ? source_stat(relative_path(path.c_str()), &e->attr, AT_SYMLINK_NOFOLLOW, &branch)
+                      : fstatat(parent->fd, name, &e->attr, AT_SYMLINK_NOFOLLOW)) {
+        return errno;
+    }
+
+    filter_ref fs;
+    if (should_hide(*fs, path.c_str(), e->attr.st_mode)) return ENOENT;
+    strip_write_perms(&e->attr);
+
+    auto same_file = [&](const ll_inode *node) {
+        return node->dev == e->attr.st_dev && node->ino == e->attr.st_ino;
+    };
+
+    std::unique_lock<std::mutex> guard(ll_inodes_lock);
+    auto it = ll_inodes.find(path);
+    if (it == ll_inodes.end() || !same_file(it->second)) {
+        guard.unlock();
+        int fd = from_top ? openat(branches[branch].fd, relative_path(path.c_str()), O_PATH | O_NOFOLLOW | O_CLOEXEC)
+                        : openat(parent->fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) return errno;
+        guard.lock();
+
+        it = ll_inodes.find(path);
+        if (it != ll_inodes.end() && same_file(it->second)) {
+            // Someone else got here first
+            close(fd);
+        } else {
+            // A node for a file that has since been replaced stays around
+            // until the kernel forgets it, but new lookups get a new node.
+            ll_inode *node = new ll_inode();
+            node->path = path;
+            node->fd = fd;
+            node->dev = e->attr.st_dev;
+            node->ino = e->attr.st_ino;
+            node->mode = e->attr.st_mode & S_IFMT;
+            node->nlookup = 0;
+            node->generation = fs->generation;
+            node->hidden = false;
+            it = ll_inodes.insert_or_assign(path, node).first;
+        }
+    }
+
+    it->second->nlookup++;
+    e->ino = (fuse_ino_t)(uintptr_t)it->second;
+    return 0;
+}
+
+static void ll_forget_one(fuse_ino_t ino, uint64_t nlookup) {
+    ll_inode *node = ll_node(ino);
+    if (node == &ll_root) return;
+
+    std::unique_lock<std::mutex> guard(ll_inodes_lock);
+    assert(node->nlookup >= nlookup);
+    node->nlookup -= nlookup;
+    if (node->nlookup) return;
+
+    auto it = ll_inodes.find(node->path);
+    if (it != ll_inodes.end() && it->second == node) ll_inodes.erase(it);
+    guard.unlock();
+
+    close(node->fd);
+    delete node;
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+    (void) userdata;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (conf.passthrough) {
+        if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+            conn->want |= FUSE_CAP_PASSTHROUGH;
+            ll_passthrough = true;
+        } else {
+            log_msg(LOG_WARNING, "%s: The kernel does not support passthrough. Reads will go through %s.",
+                    PACKAGE_STRING, EXEC_NAME);
+        }
+    }
+#endif
+
+    callback_init(conn, NULL);
+}
+
+static void ll_destroy(void *userdata) {
+    callback_destroy(userdata);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    log_debug("%s(%s)", __PRETTY_FUNCTION__, name);
+    ll_inode *dir = ll_node(parent);
+    op_timer timer(OP_LOOKUP, conf.trace ? ll_trace_path(dir, name) : NULL);
+
+    if (ll_hidden(dir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct fuse_entry_param e;
+    int err = ll_lookup_node(dir, name, &e);
+    if (err == ENOENT && ll_negative_timeout > 0) {
+        // Hidden files included, so scanners probing for them stop asking
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = ll_negative_timeout;
+        fuse_reply_entry(req, &e);
+    } else if (err) {
+        fuse_reply_err(req, err);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    ll_forget_one(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        ll_forget_one(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    ll_inode *node = ll_node(ino);
+    op_timer timer(OP_GETATTR, node->path.c_str());
+    if (ll_hidden(node)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+#if HAVE_LIBURING
+    // Reply from the reaper thread, so this worker can take the next request
+    if (!fi) {
+        struct statx *stx = new struct statx;
+        if (uring.submit([&](io_uring_sqe *sqe) {
+                io_uring_prep_statx(sqe, node->fd, "", AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, stx);
+            }, [req, stx, start = timer.started(), path = conf.trace ? node->path : std::string()](int res) {
+                if (res < 0) {
+                    fuse_reply_err(req, -res);
+                } else {
+                    struct stat st;
+                    statx_to_stat(*stx, &st);
+                    strip_write_perms(&st);
+                    fuse_reply_attr(req, &st, ll_attr_timeout);
+                }
+                delete stx;
+                op_timer::finish(OP_GETATTR, start, path.c_str());
+            })) {
+            timer.dismiss();
+            return;
+        }
+        delete stx;
+    }
+#endif
+
+    struct stat st;
+    int res = fi ? fstat(((open_file *)fi->fh)->fd, &st)
+                 : fstatat(node->fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    strip_write_perms(&st);
+    fuse_reply_attr(req, &st, ll_attr_timeout);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    ll_inode *node = ll_node(ino);
+    op_timer timer(OP_READLINK, node->path.c_str());
+    if (ll_hidden(node)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    char buf[PATH_MAX + 1];
+    ssize_t res = readlinkat(node->fd, "", buf, sizeof(buf) - 1);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    buf[res] = '\0';
+    fuse_reply_readlink(req, buf);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    ll_inode *node = ll_node(ino);
+    log_debug("%s(%s)", __PRETTY_FUNCTION__, node->path.c_str());
+    op_timer timer(OP_OPEN, node->path.c_str(), fi->flags);
+    if (ll_hidden(node)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    int flags = fi->flags;
+    if ((flags & O_WRONLY) || (flags & O_RDWR) || (flags & O_CREAT) || (flags & O_EXCL) || (flags & O_TRUNC)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    // An O_PATH descriptor can't be read from, but it can be reopened
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", node->fd);
+    int fd = open(proc_path, flags & ~O_NOFOLLOW);
+    if (fd == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    open_file *file = new open_file(fd);
+    set_cache_policy(node->path, fd, fi);
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    // The file has passed the filter, so the kernel may as well read it (and
+    // mmap or splice it) without coming back to us. The kernel doesn't allow
+    // that for direct_io files.
+    if (ll_passthrough && !fi->direct_io) {
+        int backing_id = fuse_passthrough_open(req, fd);
+        if (backing_id > 0) {
+            file->backing_id = backing_id;
+            fi->backing_id = backing_id;
+        } else {
+            log_debug("%s: passthrough not possible for %s", PACKAGE_STRING, node->path.c_str());
+        }
+    }
+#endif
+
+    fi->fh = (uint64_t)file;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    const char *path = conf.trace ? ll_node(ino)->path.c_str() : NULL;
+    op_timer timer(OP_READ, path, off, size);
+    open_file *file = (open_file *)fi->fh;
+
+    prefetch(file, off, size);
+
+#if HAVE_LIBURING
+    // Reply from the reaper thread, so this worker can take the next request
+    // while the read is in flight. Splicing keeps the data in the kernel, so
+    // that still goes through fuse_reply_data().
+    if (!conf.splice_read) {
+        char *data = (char *)malloc(size);
+        if (data && uring.submit([&](io_uring_sqe *sqe) {
+                io_uring_prep_read(sqe, file->fd, data, size, off);
+            }, [req, data, start = timer.started(), path = std::string(path ? path : ""), off, size](int res) {
+                if (res < 0) {
+                    fuse_reply_err(req, -res);
+                } else {
+                    fuse_reply_buf(req, data, res);
+                    metric_add(METRIC_READ_BYTES, res);
+                }
+                free(data);
+                op_timer::finish(OP_READ, start, path.c_str(), off, size);
+            })) {
+            timer.dismiss();
+            return;
+        }
+        free(data);
+    }
+#endif
+
+    // Let libfuse read (or splice) the data straight from the source file
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    buf.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buf.buf[0].fd = file->fd;
+    buf.buf[0].pos = off;
+
+    if (fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE) == 0) metric_add(METRIC_READ_BYTES, size);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) ino;
+    int res = close(dup(((open_file *)fi->fh)->fd));
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) ino;
+    open_file *file = (open_file *)fi->fh;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (file->backing_id) fuse_passthrough_close(req, file->backing_id);
+#endif
+
+    close(file->fd);
+    delete file;
+    fuse_reply_err(req, 0);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    (void) ino;
+    (void) datasync;
+    (void) fi;
+    fuse_reply_err(req, 0);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    ll_inode *node = ll_node(ino);
+    log_debug("%s(%s)", __PRETTY_FUNCTION__, node->path.c_str());
+    op_timer timer(OP_OPENDIR, node->path.c_str());
+    if (ll_hidden(node)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    std::unique_ptr<dir_handle> handle(new dir_handle());
+    handle->served = false;
+    filter_ref fs;
+    int res = list_dir(*fs, node->path.c_str(), *handle);
+    if (res) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fi->fh = (uint64_t)handle.release();
+    fuse_reply_open(req, fi);
+}
+
+/** Fill a readdir (or readdirplus) reply with the entries starting at "off".
+ * As with callback_readdir(), the offset of an entry is its index plus one. */
+static void ll_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                          struct fuse_file_info *fi, bool plus) {
+    ll_inode *node = ll_node(ino);
+    op_timer timer(OP_READDIR, node->path.c_str(), off);
+    dir_handle *handle = (dir_handle *)fi->fh;
+
+    if (off == 0 && handle->served) {
+        filter_ref fs;
+        int res = list_dir(*fs, node->path.c_str(), *handle);
+        if (res) {
+            fuse_reply_err(req, -res);
+            return;
+        }
+    }
+    handle->served = true;
+
+    static thread_local std::vector<char> buf;
+    buf.resize(size);
+    size_t used = 0;
+
+    struct stat plus_st[stat_batch_size];
+    bool have_plus_st[stat_batch_size];
+
+    // With a single branch the node is the directory to stat the entries in
+    source_dir plus_dir;
+    const int *plus_fds = &node->fd;
+    if (node == &ll_root && !views.empty()) plus = false;
+    if (plus && branches.size() > 1) {
+        if (plus_dir.open(relative_path(node->path.c_str()), false)) plus = false;
+        plus_fds = plus_dir.fds();
+    }
+
+    for (size_t i = off; i < handle->entries.size(); i++) {
+        const auto &entry = handle->entries[i];
+        size_t entsize;
+
+        if (plus) {
+            const size_t slot = (i - off) % stat_batch_size;
+            if (slot == 0) {
+                stat_entries(plus_fds, *handle, &entry, std::min(stat_batch_size, handle->entries.size() - i),
+                             plus_st, have_plus_st);
+            }
+
+            // Every entry handed out with its attributes counts as a lookup
+            struct fuse_entry_param e;
+            const char *name = handle->name(entry);
+            bool dot = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+            if (dot || !have_plus_st[slot]
+                    || ll_lookup_node(node, name, &e, &plus_st[slot], entry.branch)) {
+                memset(&e, 0, sizeof(e));
+                e.attr.st_ino = entry.ino;
+                e.attr.st_mode = entry.mode;
+            }
+            entsize = fuse_add_direntry_plus(req, buf.data() + used, size - used, name, &e, i + 1);
+            if (entsize > size - used) {
+                if (e.ino) ll_forget_one(e.ino, 1);
+                break;
+            }
+        } else {
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_ino = entry.ino;
+            st.st_mode = entry.mode;
+            entsize = fuse_add_direntry(req, buf.data() + used, size - used, handle->name(entry), &st, i + 1);
+            if (entsize > size - used) break;
+        }
+
+        used += entsize;
+    }
+
+    fuse_reply_buf(req, buf.data(), used);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    ll_do_readdir(req, ino, size, off, fi, false);
+}
+
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    ll_do_readdir(req, ino, size, off, fi, true);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) ino;
+    delete (dir_handle *)fi->fh;
+    fuse_reply_err(req, 0);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    ll_inode *node = ll_node(ino);
+    op_timer timer(OP_STATFS, node->path.c_str());
+    if (ll_hidden(node)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct statvfs st_buf;
+    if (fstatvfs(node->fd, &st_buf) == -1) {
+        fuse_reply_err(req, errno);
+    } else {
+        fuse_reply_statfs(req, &st_buf);
+    }
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    ll_inode *node = ll_node(ino);
+    op_timer timer(OP_GETXATTR, node->path.c_str(), 0, size);
+    if (ll_hidden(node)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    std::vector<char> value(size);
+    ssize_t res;
+    if (conf.metrics && node == &ll_root && strcmp(name, metrics_xattr) == 0) {
+        res = metrics_xattr_value(size ? value.data() : NULL, size);
+        if (res < 0) {
+            errno = -res;
+            res = -1;
+        }
+    } else {
+        res = lgetxattr(translate_path(node->path.c_str()), name, size ? value.data() : NULL, size);
+    }
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+    } else if (size == 0) {
+        fuse_reply_xattr(req, res);
+    } else {
+        fuse_reply_buf(req, value.data(), res);
+    }
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    ll_inode *node = ll_node(ino);
+    op_timer timer(OP_LISTXATTR, node->path.c_str(), 0, size);
+    if (ll_hidden(node)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    std::vector<char> list(size);
+    ssize_t res = llistxattr(translate_path(node->path.c_str()), size ? list.data() : NULL, size);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+    } else if (size == 0) {
+        fuse_reply_xattr(req, res);
+    } else {
+        fuse_reply_buf(req, list.data(), res);
+    }
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+    ll_inode *node = ll_node(ino);
+    op_timer timer(OP_ACCESS, node->path.c_str(), mask);
+    if (ll_hidden(node)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (mask & W_OK) {
+        fuse_reply_err(req, EPERM);     // We are ReadOnly
+        return;
+    }
+
+    int res = faccessat(source_fd(relative_path(node->path.c_str())), relative_path(node->path.c_str()), mask, 0);
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+// Nothing can be changed through the mount
+static void ll_setattr(fuse_req_t req, fuse_ino_t, struct stat *, int, struct fuse_file_info *) { fuse_reply_err(req, EPERM); }
+static void ll_mknod(fuse_req_t req, fuse_ino_t, const char *, mode_t, dev_t) { fuse_reply_err(req, EPERM); }
+static void ll_mkdir(fuse_req_t req, fuse_ino_t, const char *, mode_t) { fuse_reply_err(req, EPERM); }
+static void ll_unlink(fuse_req_t req, fuse_ino_t, const char *) { fuse_reply_err(req, EPERM); }
+static void ll_rmdir(fuse_req_t req, fuse_ino_t, const char *) { fuse_reply_err(req, EPERM); }
+static void ll_symlink(fuse_req_t req, const char *, fuse_ino_t, const char *) { fuse_reply_err(req, EPERM); }
+static void ll_rename(fuse_req_t req, fuse_ino_t, const char *, fuse_ino_t, const char *, unsigned int) { fuse_reply_err(req, EPERM); }
+static void ll_link(fuse_req_t req, fuse_ino_t, fuse_ino_t, const char *) { fuse_reply_err(req, EPERM); }
+static void ll_write(fuse_req_t req, fuse_ino_t, const char *, size_t, off_t, struct fuse_file_info *) { fuse_reply_err(req, EPERM); }
+static void ll_setxattr(fuse_req_t req, fuse_ino_t, const char *, const char *, size_t, int) { fuse_reply_err(req, EPERM); }
+static void ll_removexattr(fuse_req_t req, fuse_ino_t, const char *) { fuse_reply_err(req, EPERM); }
+static void ll_create(fuse_req_t req, fuse_ino_t, const char *, mode_t, struct fuse_file_info *) { fuse_reply_err(req, EPERM); }
+
+static struct fuse_lowlevel_ops ll_oper = {
+    .init       = ll_init,
+    .destroy    = ll_destroy,
+    .lookup     = ll_lookup,
+    .forget     = ll_forget,
+    .getattr    = ll_getattr,
+    .setattr    = ll_setattr,
+    .readlink   = ll_readlink,
+    .mknod      = ll_mknod,
+    .mkdir      = ll_mkdir,
+    .unlink     = ll_unlink,
+    .rmdir      = ll_rmdir,
+    .symlink    = ll_symlink,
+    .rename     = ll_rename,
+    .link       = ll_link,
+    .open       = ll_open,
+    .read       = ll_read,
+    .write      = ll_write,
+    .flush      = ll_flush,
+    .release    = ll_release,
+    .fsync      = ll_fsync,
+    .opendir    = ll_opendir,
+    .readdir    = ll_readdir,
+    .releasedir = ll_releasedir,
+    // .fsyncdir
+    .statfs     = ll_statfs,
+    .setxattr   = ll_setxattr,
+    .getxattr   = ll_getxattr,
+    .listxattr  = ll_listxattr,
+    .removexattr= ll_removexattr,
+    .access     = ll_access,
+    .create     = ll_create,
+    // .getlk ... .retrieve_reply
+    .forget_multi = ll_forget_multi,
+    // .flock
+    // .fallocate
+    .readdirplus= ll_readdirplus,
+};
+
+/** Mount and serve the file system through the low-level API, the equivalent
+ * of what fuse_main() does for the high-level one. */
+static int ll_main(struct fuse_args *args) {
+    ll_root.path = "/";
+    ll_root.fd = rw_fd;
+    ll_root.mode = S_IFDIR;
+    if (conf.entry_timeout >= 0) ll_entry_timeout = conf.entry_timeout;
+    if (conf.attr_timeout >= 0) ll_attr_timeout = conf.attr_timeout;
+    if (conf.negative_timeout >= 0) ll_negative_timeout = conf.negative_timeout;
+
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(args, &opts) != 0) return 1;
+    scope_guard free_mountpoint = [&](){ free(opts.mountpoint); };
+
+    if (opts.mountpoint == NULL) {
+        log_msg(LOG_ERR, "%s: A mount point was not provided.", PACKAGE_STRING);
+        return 2;
+    }
+
+    struct fuse_session *se = fuse_session_new(args, &ll_oper, sizeof(ll_oper), NULL);
+    if (se == NULL) return 1;
+    scope_guard destroy_session = [&](){ fuse_session_destroy(se); };
+
+    if (fuse_set_signal_handlers(se) != 0) return 1;
+    scope_guard remove_handlers = [&](){ fuse_remove_signal_handlers(se); };
+
+    if (fuse_session_mount(se, opts.mountpoint) != 0) return 1;
+    scope_guard unmount = [&](){ fuse_session_unmount(se); };
+
+    fuse_daemonize(opts.foreground);
+
+    int res = opts.singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se, opts.clone_fd);
+    return res ? 1 : 0;
+}
+
+#endif  // USE_LOWLEVEL
+
 #define ROFS_OPT(t, p, v) { t, offsetof(struct rofs_config, p), v }
 
 static struct fuse_opt rofs_opts[] = {
-    ROFS_OPT("source=%s",       rw_path, 0),
+    FUSE_OPT_KEY("source=%s",   KEY_SOURCE),
+    FUSE_OPT_KEY("view=%s",     KEY_VIEW),
     ROFS_OPT("config=%s",       config, 0),
     ROFS_OPT("-c %s",           config, 0),
     ROFS_OPT("invert",          invert, 1),
     ROFS_OPT("preserve-perms",  preserve_perms, 1),
+    ROFS_OPT("splice_read",     splice_read, 1),
+    ROFS_OPT("attr_cache_ttl=%lf",          attr_cache_ttl, 0),
+    ROFS_OPT("attr_cache_max_entries=%u",   attr_cache_max_entries, 0),
+    ROFS_OPT("regex_engine=%s",             regex_engine, 0),
+    ROFS_OPT("watch_config",                watch_config, 1),
+    ROFS_OPT("passthrough",                 passthrough, 1),
+    ROFS_OPT("readahead_kb=%u",             readahead_kb, 0),
+    ROFS_OPT("uring_depth=%u",              uring_depth, 0),
+    ROFS_OPT("index=%s",                    index, 0),
+    ROFS_OPT("prewarm",                     prewarm, 1),
+    ROFS_OPT("walk_threads=%u",             walk_threads, 0),
+    ROFS_OPT("metrics",                     metrics, 1),
+    ROFS_OPT("metrics_file=%s",             metrics_file, 0),
+    ROFS_OPT("metrics_interval=%lf",        metrics_interval, 0),
+    ROFS_OPT("trace=%s",                    trace, 0),
+    ROFS_OPT("keep_cache",                  keep_cache, KEEP_CACHE_ALWAYS),
+    ROFS_OPT("keep_cache=mtime",            keep_cache, KEEP_CACHE_MTIME),
+    ROFS_OPT("entry_timeout=%lf",           entry_timeout, 0),
+    ROFS_OPT("attr_timeout=%lf",            attr_timeout, 0),
+    ROFS_OPT("negative_timeout=%lf",        negative_timeout, 0),
     ROFS_OPT("debug",           debug, 1),
     // ROFS_OPT("debug-inner",     debug, 1),
 
@@ -753,6 +1928,7 @@ static struct fuse_opt rofs_opts[] = {
     FUSE_OPT_KEY("--help",      KEY_HELP),
     FUSE_OPT_KEY("-d",          KEY_DEBUG),
     FUSE_OPT_KEY("--debug",     KEY_DEBUG),
+    FUSE_OPT_KEY("--build-index",   KEY_BUILD_INDEX),
     FUSE_OPT_END
 };
 
@@ -765,61 +1941,274 @@ static int rofs_opt_proc(void *data, const char *arg, int key, struct fuse_args
                 "    -o opt,[opt...]         mount options\n"
                 "    -h --help               print help\n"
                 "    -V --version            print version\n"
+                "    --build-index           write the index file (-o index) and exit\n"
                 "\n"
                 "rofs-filtered options:\n"
-                "    -o source=DIR           directory to mount as read-only and filter\n"
+                "    -o source=DIR           directory to mount as read-only and filter,\n"
+                "                            several of them are overlaid, the first\n"
+                "                            one that has a path wins\n"
                 "    -o config=CONFIG_FILE   config file path (default: %s)\n"
+                "    -o view=NAME:CONFIG_FILE\n"
+                "                            show the source filtered by CONFIG_FILE in\n"
+                "                            the NAME directory, instead of config; can be\n"
+                "                            given up to %zu times\n"
                 "    -o invert               the config file specifies files to allow\n"
                 "    -o preserve-perms        do not clear write permission\n"
+                "    -o splice_read          splice file data directly from the source\n"
+                "    -o attr_cache_ttl=T     cache attributes and filter results for T seconds\n"
+                "    -o attr_cache_max_entries=N\n"
+                "                            number of paths to cache (default: %u)\n"
+                "    -o regex_engine=ENGINE  posix or re2 (default: re2 if available)\n"
+                "    -o watch_config         reload the config file when it changes\n"
+                "    -o passthrough          let the kernel read allowed files directly\n"
+                "    -o readahead_kb=N       prefetch N KiB ahead of sequential readers\n"
+#if HAVE_LIBURING
+                "    -o uring_depth=N        io_uring requests in flight, 0 to disable\n"
+                "                            (default: %u)\n"
+#endif
+                "    -o keep_cache[=mtime]   keep cached file data across opens (unless the\n"
+                "                            source file changed)\n"
+                "    -o entry_timeout=T      cache names for T seconds (default: 1)\n"
+                "    -o attr_timeout=T       cache attributes for T seconds (default: 1)\n"
+                "    -o negative_timeout=T   cache missing and hidden names for T seconds\n"
+                "                            (default: 0)\n"
+                "    -o index=FILE           take the filter results from FILE, built at\n"
+                "                            mount time if missing or out of date\n"
+                "    -o prewarm              walk the source and fill the caches before\n"
+                "                            mounting (the attribute cache too, with\n"
+                "                            attr_cache_ttl, except with low-level FUSE)\n"
+                "    -o walk_threads=N       threads for prewarm and --build-index\n"
+                "                            (default: one per core)\n"
+                "    -o metrics              count calls, verdicts and cache hits, readable\n"
+                "                            from the %s xattr of the root\n"
+                "    -o metrics_file=FILE    write the metrics to FILE as well (implies metrics)\n"
+                "    -o metrics_interval=T   every T seconds (default: %g)\n"
+                "    -o trace=FILE           record every call in FILE, for\n"
+                "                            rofs-filtered-replay\n"
                 "\n"
-                , outargs->argv[0], default_config_file);
+                , outargs->argv[0], default_config_file, max_views, default_attr_cache_max_entries
+#if HAVE_LIBURING
+                , default_uring_depth
+#endif
+                , metrics_xattr, default_metrics_interval
+                );
         // Let fuse print out its help text as well...
+#if USE_LOWLEVEL
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        exit(1);
+#elif HAVE_FUSE3
+        fuse_opt_add_arg(outargs, "--help");
+#else
         fuse_opt_add_arg(outargs, "-ho");
-        fuse_main(outargs->argc, outargs->argv, &callback_oper);
+#endif
+        fuse_main(outargs->argc, outargs->argv, &callback_oper, NULL);
         exit(1);
 
     case KEY_VERSION:
         fprintf(stderr, "%s version: %s\n", EXEC_NAME, PACKAGE_VERSION);
         // Let fuse also print its version
+#if USE_LOWLEVEL
+        fprintf(stderr, "FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        exit(0);
+#endif
         fuse_opt_add_arg(outargs, "--version");
-        fuse_main(outargs->argc, outargs->argv, &callback_oper);
+        fuse_main(outargs->argc, outargs->argv, &callback_oper, NULL);
         exit(0);
 
     case KEY_DEBUG:
         fprintf(stderr, "Enable extra logging\n");
         conf.debug = 1;
         break;
+
+    case KEY_BUILD_INDEX:
+        conf.build_index = 1;
+        return 0;
+
+    case KEY_SOURCE:
+        source_paths.push_back(arg + strlen("source="));
+        return 0;
+
+    case KEY_VIEW: {
+        std::string view = arg + strlen("view=");
+        size_t colon = view.find(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == view.size()) {
+            log_msg(LOG_ERR, "%s: A view is given as view=NAME:CONFIG_FILE, not %s", PACKAGE_STRING, arg);
+            exit(2);
+        }
+        std::string name = view.substr(0, colon);
+        if (name == "." || name == ".." || name.find('/') != std::string::npos) {
+            log_msg(LOG_ERR, "%s: Invalid view name: %s", PACKAGE_STRING, name.c_str());
+            exit(2);
+        }
+        bool taken = std::any_of(views.begin(), views.end(), [&](const source_view &v) { return v.name == name; });
+        if (taken || views.size() == max_views) {
+            log_msg(LOG_ERR, "%s: %s", PACKAGE_STRING, taken ? "Two views can not have the same name"
+                    : "Too many views");
+            exit(2);
+        }
+
+        // Read again on reload, after the daemon has changed its working
+        // directory
+        views.push_back({ name, std::filesystem::absolute(view.substr(colon + 1)).string() });
+        return 0;
+    }
     }
     return 1;
 }
 
 int main(int argc, char *argv[]) {
     openlog(EXEC_NAME, LOG_PID, log_facility);
-    for (int i = 0; i < argc; i++) log_msg(LOG_DEBUG, "    arg %i = %s", i, argv[i]);
+    for (int i = 0; i < argc; i++) log_debug("    arg %i = %s", i, argv[i]);
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     memset(&conf, 0, sizeof(conf));
+    conf.attr_cache_max_entries = default_attr_cache_max_entries;
+    conf.uring_depth = default_uring_depth;
+    conf.metrics_interval = default_metrics_interval;
+    conf.entry_timeout = conf.attr_timeout = conf.negative_timeout = -1;
     fuse_opt_parse(&args, &conf, rofs_opts, rofs_opt_proc);
 
+    if (conf.config && !views.empty()) {
+        log_msg(LOG_WARNING, "%s: The views have config files of their own, ignoring %s", PACKAGE_STRING, conf.config);
+    }
     if (conf.config == NULL) conf.config = default_config_file;
 
-    if (conf.rw_path == NULL) {
+    // The config file is read again on reload, after the daemon has changed
+    // its working directory.
+    static const std::string config_path = std::filesystem::absolute(conf.config).string();
+    conf.config = config_path.c_str();
+
+    if (source_paths.empty()) {
         log_msg(LOG_ERR, "%s: A source directory was not provided.", PACKAGE_STRING);
         log_msg(LOG_ERR, "%s: See '%s -h' for usage.", PACKAGE_STRING, argv[0]);
         exit(2);
     }
 
-    if (access(conf.rw_path, F_OK)) {
-        log_msg(LOG_ERR, "%s: The following source directory does not exist: %s", PACKAGE_STRING, conf.rw_path);
-        exit(2);
+    std::string sources;
+    for (const auto &source : source_paths) {
+        if (access(source.c_str(), F_OK)) {
+            log_msg(LOG_ERR, "%s: The following source directory does not exist: %s", PACKAGE_STRING, source.c_str());
+            exit(2);
+        }
+
+        // The branches keep their full path for the xattr calls, which still
+        // need it after the daemon has changed its working directory.
+        int res = add_branch(source.c_str());
+        if (res) {
+            log_msg(LOG_ERR, "%s: Can not open source directory %s: %s", PACKAGE_STRING, source.c_str(), strerror(-res));
+            exit(2);
+        }
+        if (!sources.empty()) sources += ", ";
+        sources += branches.back().path;
     }
+    conf.rw_path = branches[0].path.c_str();
 
-    log_msg(LOG_INFO, "%s: Starting up. Using source: %s and config: %s", PACKAGE_STRING, conf.rw_path, conf.config);
+    log_msg(LOG_INFO, "%s: Starting up. Using source: %s and config: %s", PACKAGE_STRING, sources.c_str(),
+            views.empty() ? conf.config : "one per view");
+    for (const auto &view : views) {
+        log_msg(LOG_INFO, "%s: View %s uses config: %s", PACKAGE_STRING, view.name.c_str(), view.config.c_str());
+    }
 
-    if (read_config(conf.config)) {
-        log_msg(LOG_ERR, "%s: Error parsing config file: %s", PACKAGE_STRING, conf.config);
+    auto fs = std::make_shared<filter_set>();
+    std::string failed;
+    if (read_filters(*fs, failed)) {
+        log_msg(LOG_ERR, "%s: Error parsing config file: %s", PACKAGE_STRING, failed.c_str());
         exit(3);
     }
+    publish_filters(fs);
+
+    if (conf.index) {
+        static const std::string index_path = std::filesystem::absolute(conf.index).string();
+        conf.index = index_path.c_str();
+    }
+
+    if (conf.metrics_file) {
+        static const std::string metrics_path = std::filesystem::absolute(conf.metrics_file).string();
+        conf.metrics_file = metrics_path.c_str();
+        conf.metrics = 1;
+        if (conf.metrics_interval <= 0) conf.metrics_interval = default_metrics_interval;
+    }
+
+    if (conf.trace) {
+        static const std::string trace_path = std::filesystem::absolute(conf.trace).string();
+        conf.trace = trace_path.c_str();
+    }
+
+    if (conf.build_index) {
+        if (conf.index == NULL) {
+            log_msg(LOG_ERR, "%s: --build-index needs -o index=FILE", PACKAGE_STRING);
+            exit(2);
+        }
+        std::atomic<bool> stop(false);
+        int res = build_index(*fs, conf.index, stop);
+        if (res) {
+            log_msg(LOG_ERR, "%s: Can not write the index %s: %s", PACKAGE_STRING, conf.index, strerror(-res));
+            exit(1);
+        }
+        exit(0);
+    }
+
+    if (conf.index) {
+        int res = load_index(*fs, conf.index);
+        if (res) {
+            log_msg(LOG_INFO, "%s: The index %s is %s, it will be rebuilt", PACKAGE_STRING, conf.index,
+                    res == -ESTALE ? "out of date" : strerror(-res));
+        }
+    }
 
-    return fuse_main(args.argc, args.argv, &callback_oper);
+    // The source is not expected to change any faster than our own cache
+    // notices, so let the kernel hold on to entries for as long, unless told
+    // otherwise.
+    if (conf.attr_cache_ttl > 0) {
+        if (conf.entry_timeout < 0) conf.entry_timeout = conf.attr_cache_ttl;
+        if (conf.attr_timeout < 0) conf.attr_timeout = conf.attr_cache_ttl;
+        if (conf.negative_timeout < 0) conf.negative_timeout = conf.attr_cache_ttl;
+    }
+
+#if !USE_LOWLEVEL || !defined(FUSE_CAP_PASSTHROUGH)
+    if (conf.passthrough) {
+        log_msg(LOG_WARNING, "%s: The passthrough option needs a low-level FUSE 3.16 (or later) build. Ignoring it.",
+                PACKAGE_STRING);
+    }
+#endif
+
+#if USE_LOWLEVEL
+    // Filter verdicts are cached with the inodes, and the kernel timeouts and
+    // splicing are set up by ll_main() and ll_init() instead of through
+    // libfuse options.
+    if (conf.prewarm) prewarm(*fs);
+    return ll_main(&args);
+#else
+    if (conf.attr_cache_ttl > 0) {
+        attr_cache.set_capacity(conf.attr_cache_max_entries);
+    }
+    if (conf.prewarm) prewarm(*fs);
+
+#if !HAVE_FUSE3
+    // FUSE 3 takes these from callback_init(), FUSE 2 only as options
+    const std::pair<const char *, double> timeouts[] = {
+        { "entry_timeout", conf.entry_timeout },
+        { "attr_timeout", conf.attr_timeout },
+        { "negative_timeout", conf.negative_timeout },
+    };
+    for (const auto &timeout : timeouts) {
+        if (timeout.second < 0) continue;
+        char opt[64];
+        snprintf(opt, sizeof(opt), "-o%s=%g", timeout.first, timeout.second);
+        fuse_opt_add_arg(&args, opt);
+    }
+#endif
+
+    if (conf.splice_read) {
+        // Serve reads through read_buf and let libfuse know it may splice
+        callback_oper.read_buf = callback_read_buf;
+#if !HAVE_FUSE3
+        fuse_opt_add_arg(&args, "-osplice_read");
+#endif
+    }
+
+    return fuse_main(args.argc, args.argv, &callback_oper, NULL);
+#endif
 }
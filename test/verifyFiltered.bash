@@ -3,6 +3,16 @@
 cd $(dirname "$0")
 . verifyPrelude.bash
 "$EXE" $MNT -o source="$PWD"/sourceDir -o config="$SRC"/rofs-filtered.rc
+
+# The files of a hidden directory can't be reached by name either, the second
+# time through the cached verdict of the directory
+for pass in 1 2; do
+    for cmd in "stat $MNT/subDir2/fileA.mp3" "cat $MNT/subDir2/fileA.mp3" "ls $MNT/subDir2"; do
+        LC_ALL=C $cmd 2>&1 >/dev/null | grep -q 'No such file or directory' \
+            || fail "$cmd did not fail with ENOENT"
+    done
+done
+
 . verifyPostlude.bash <<EOF
 file1.mp3
 file2.mp3
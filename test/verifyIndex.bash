@@ -0,0 +1,56 @@
+#!/bin/bash
+
+cd $(dirname "$0")
+. verifyPrelude.bash
+
+# An index built for other rules is not used: the ones mounted with decide,
+# here to show subDir2 and file1.flac which rofs-filtered.rc hides.
+INDEX="$PWD"/verifyIndex.$$.idx
+"$EXE" --build-index -o source="$PWD"/sourceDir -o config="$SRC"/rofs-filtered.rc -o index="$INDEX" || exit 1
+"$EXE" $MNT -o source="$PWD"/sourceDir -o config="$SRC"/test/verifyExtensionPriority.rc -o index="$INDEX"
+if [ ! -e $MNT/file1.flac ] || [ ! -e $MNT/subDir2/file4.flac ]; then
+    rm -f "$INDEX"
+    fail "The verdicts of an index built for other rules were used"
+fi
+fusermount -u $MNT || umount $MNT
+
+# Build the index, then change one directory behind its back. Its verdicts
+# should be computed again instead of taken from the stale index, the rest
+# taken from the index.
+"$EXE" --build-index -o source="$PWD"/sourceDir -o config="$SRC"/test/verifyExtensionPriority.rc -o index="$INDEX" || exit 1
+sleep 0.1
+touch sourceDir/subDir1/fileA.flac
+"$EXE" $MNT -o source="$PWD"/sourceDir -o config="$SRC"/test/verifyExtensionPriority.rc -o index="$INDEX" \
+    -o metrics_file="$METRICS",metrics_interval=0.1
+rm -f "$INDEX"
+
+ls -R $MNT >/dev/null
+FROM_INDEX=$(metric 'verdict_sources_total{source="index"}')
+[ "${FROM_INDEX:-0}" -gt 0 ] || fail "No verdicts were taken from the index"
+
+. verifyPostlude.bash <<EOF
+external-linked.txt
+file1.flac
+file2.mp3
+file3.mp3
+image1.raw
+image2.jpeg
+image3.jpg
+type:LNK
+
+extSubDir:
+external-linked.txt
+
+subDir1:
+file3.flac
+fileA.flac
+pipe
+socket
+subSubDir1
+
+subDir1/subSubDir1:
+
+subDir2:
+file4.flac
+fileA.mp3
+EOF
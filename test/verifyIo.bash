@@ -0,0 +1,61 @@
+#!/bin/bash
+
+cd $(dirname "$0")
+. verifyPrelude.bash
+
+# Reads of the files under a |io:direct_io: line go around the page cache, so
+# they reach rofs-filtered the size they were made, without the kernel's
+# readahead. Files under a |io:keep_cache: line keep their cached pages from
+# one open to the next, so reading one twice only reaches rofs-filtered once.
+# With readahead_kb, the source is asked for what comes next in the files.
+head -c 65536 /dev/zero > sourceDir/file2.mp3
+head -c 65536 /dev/zero > sourceDir/image3.jpg
+CONFIG="$PWD"/verifyIo.$$.rc
+printf '%s\n' '\.flac$' '|io:direct_io:\.mp3$' '|io:keep_cache:\.jpg$' > "$CONFIG"
+"$EXE" $MNT -o source="$PWD"/sourceDir -o config="$CONFIG" -o metrics_file="$METRICS",metrics_interval=0.1 \
+    -o readahead_kb=256
+rm -f "$CONFIG"
+
+BEFORE=$(metric read_bytes_total)
+dd if=$MNT/file2.mp3 of=/dev/null bs=4096 count=1 2>/dev/null
+READ=$(( $(metric read_bytes_total) - BEFORE ))
+[ "$READ" == 4096 ] || fail "Reading 4096 bytes of a direct_io file read $READ bytes of the source"
+
+BEFORE=$(metric read_bytes_total)
+cat $MNT/image3.jpg >/dev/null
+cat $MNT/image3.jpg >/dev/null
+READ=$(( $(metric read_bytes_total) - BEFORE ))
+[ "$READ" == 65536 ] || fail "Reading a keep_cache file twice read $READ bytes of the source"
+
+PREFETCHED=$(metric prefetched_bytes_total)
+[ "${PREFETCHED:-0}" -gt 0 ] || fail "Nothing was prefetched ahead of the reads"
+
+. verifyPostlude.bash <<EOF
+external-linked.txt
+file1.mp3
+file2.mp3
+file3.mp3
+image1.jpeg
+image1.jpg
+image1.raw
+image2.jpeg
+image2.jpg
+image3.jpg
+type:LNK
+
+extSubDir:
+external-linked.txt
+
+subDir1:
+file3.mp3
+fileA.mp3
+pipe
+socket
+subSubDir1
+
+subDir1/subSubDir1:
+
+subDir2:
+file4.mp3
+fileA.mp3
+EOF
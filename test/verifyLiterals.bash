@@ -0,0 +1,42 @@
+#!/bin/bash
+
+cd $(dirname "$0")
+. verifyPrelude.bash
+
+# The same rules written as plain literals, which literal_matcher takes, and
+# as regexes it has to leave to the regex engine. Both should hide the same
+# entries.
+CONFIG="$PWD"/verifyLiterals.$$.rc
+printf '%s\n' '[.]flac$' '^/subDir(2)$' '^/image(1)' 'jpe(g)' > "$CONFIG"
+"$EXE" $MNT -o source="$PWD"/sourceDir -o config="$CONFIG"
+REGEX_LISTING=$(cd $MNT && ls -R -1 *)
+fusermount -u $MNT || umount $MNT
+
+printf '%s\n' '\.flac$' '^/subDir2$' '^/image1' 'jpeg' > "$CONFIG"
+"$EXE" $MNT -o source="$PWD"/sourceDir -o config="$CONFIG"
+rm -f "$CONFIG"
+if ! diff <(cd $MNT && ls -R -1 *) <(echo "$REGEX_LISTING"); then
+    fail "The literal rules and the regexes hide different entries"
+fi
+
+. verifyPostlude.bash <<EOF
+external-linked.txt
+file1.mp3
+file2.mp3
+file3.mp3
+image2.jpg
+image3.jpg
+type:LNK
+
+extSubDir:
+external-linked.txt
+
+subDir1:
+file3.mp3
+fileA.mp3
+pipe
+socket
+subSubDir1
+
+subDir1/subSubDir1:
+EOF
@@ -0,0 +1,30 @@
+#!/bin/bash
+
+cd $(dirname "$0")
+. verifyPrelude.bash
+
+# Scan the mount once, the scan should then show up in the metrics file
+# (kept out of the mounted tree, and removed along with it)
+"$EXE" $MNT -o source="$PWD"/sourceDir -o config="$SRC"/rofs-filtered.rc -o metrics_file="$METRICS",metrics_interval=0.1
+ls -R $MNT >/dev/null
+OPENDIRS=$(metric 'request_duration_seconds_count{op="opendir"}')
+HIDDEN=$(metric 'verdicts_total{verdict="hidden"}')
+if [ "${OPENDIRS:-0}" -eq 0 ] || [ "${HIDDEN:-0}" -eq 0 ]; then
+    cat "$METRICS"
+    fail "The scan is missing from $METRICS"
+fi
+
+. verifyPostlude.bash <<EOF
+file1.mp3
+file2.mp3
+image1.raw
+image2.jpeg
+image3.jpg
+
+subDir1:
+file3.mp3
+fileA.mp3
+subSubDir1
+
+subDir1/subSubDir1:
+EOF
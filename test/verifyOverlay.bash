@@ -0,0 +1,50 @@
+#!/bin/bash
+
+cd $(dirname "$0")
+. verifyPrelude.bash
+
+# A second branch, overlaid on sourceDir: file2.mp3 and subDir1/file3.mp3 are
+# in both, and should be served and listed once, from the first branch. Its
+# fileA.flac hides the fileA.mp3 of the first branch (extensionPriority), and
+# its subDir2 is the newer one, so it gives the mtime of the directory.
+BRANCH="$PWD"/sourceDir2/branch
+mkdir -p "$BRANCH"/{subDir1,subDir2,newDir}
+echo second > "$BRANCH"/file2.mp3
+touch "$BRANCH"/subDir1/{file3.mp3,fileB.mp3} "$BRANCH"/subDir2/fileA.flac "$BRANCH"/newDir/file5.mp3
+touch -d @2000000000 "$BRANCH"/subDir2
+"$EXE" $MNT -o source="$PWD"/sourceDir -o source="$BRANCH" -o config="$SRC"/test/verifyExtensionPriority.rc
+
+[ ! -s $MNT/file2.mp3 ] || fail "file2.mp3 was not served from the first branch"
+MTIME=$(stat -c %Y $MNT/subDir2)
+[ "$MTIME" == 2000000000 ] || fail "The mtime of subDir2 is $MTIME instead of the latest of its branches"
+
+. verifyPostlude.bash <<EOF
+external-linked.txt
+file1.flac
+file2.mp3
+file3.mp3
+image1.raw
+image2.jpeg
+image3.jpg
+type:LNK
+
+extSubDir:
+external-linked.txt
+
+newDir:
+file5.mp3
+
+subDir1:
+file3.flac
+fileA.mp3
+fileB.mp3
+pipe
+socket
+subSubDir1
+
+subDir1/subSubDir1:
+
+subDir2:
+file4.flac
+fileA.flac
+EOF
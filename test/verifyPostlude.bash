@@ -6,7 +6,5 @@ if [[ $ret != 0 ]]; then
     cd $MNT && ls -R -1 -t * && cd -
 fi
 
-fusermount -u $MNT || umount $MNT
-nc -UN sourceDir/subDir1/socket </dev/null
-rm -rf sourceDir sourceDir2 $MNT
+teardown
 exit $ret
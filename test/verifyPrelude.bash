@@ -4,6 +4,38 @@ EXE=rofs-filtered
 SRC=/tmp
 MNT=/tmp/rofs-filtered.mnt.$$
 
+# Unmount and remove what the prelude made
+teardown() {
+    fusermount -u $MNT || umount $MNT
+    nc -UN sourceDir/subDir1/socket </dev/null
+    rm -rf sourceDir sourceDir2 $MNT
+}
+
+# Fail the test with a message, once the mount is up
+fail() {
+    echo "$@"
+    teardown
+    exit 1
+}
+
+# Where to mount with -o metrics_file, out of the mounted tree
+METRICS="$PWD"/sourceDir2/metrics.prom
+
+# Print the value of a metric, without the rofs_filtered_ prefix, once the
+# metrics file has everything done so far. It is replaced with a rename, and
+# may have been renamed in just after being removed, with metrics taken
+# before; the next one is up to date.
+metric() {
+    for pass in 1 2; do
+        rm -f "$METRICS"
+        for ((i = 0; i < 50; i++)); do
+            [ -f "$METRICS" ] && break
+            sleep 0.1
+        done
+    done
+    sed -n "s/^rofs_filtered_$1 //p" "$METRICS"
+}
+
 eval set -- $(getopt 'x:s:' "$@")
 for ((;;)); do
   case "$1" in
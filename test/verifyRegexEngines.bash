@@ -0,0 +1,61 @@
+#!/bin/bash
+
+cd $(dirname "$0")
+. verifyPrelude.bash
+
+# Names that RE2 would read differently from regexec(): one that isn't valid
+# UTF-8 (a Latin-1 "é"), and backslashes, which are plain characters in a
+# POSIX bracket expression. Both engines should hide the same ones.
+LATIN1=$'caf\xe9.mp3'
+touch sourceDir/"$LATIN1" sourceDir/'back\slash' sourceDir/back.slash sourceDir/backXslash
+CONFIG="$PWD"/verifyRegexEngines.$$.rc
+printf '%s\n' '^/caf.\.mp3$' '^/back[\.]slash$' > "$CONFIG"
+
+for ENGINE in posix re2; do
+    "$EXE" $MNT -o source="$PWD"/sourceDir -o config="$CONFIG" -o regex_engine=$ENGINE
+    for name in "$LATIN1" 'back\slash' back.slash; do
+        if [ -e "$MNT/$name" ] || ls $MNT | grep -qxF "$name"; then
+            rm -f "$CONFIG"
+            fail "$name is not hidden by the $ENGINE engine"
+        fi
+    done
+    # The postlude checks the listing of the last one
+    if [ $ENGINE != re2 ]; then
+        fusermount -u $MNT || umount $MNT
+    fi
+done
+rm -f "$CONFIG"
+
+. verifyPostlude.bash <<EOF
+backXslash
+external-linked.txt
+file1.flac
+file1.mp3
+file2.mp3
+file3.mp3
+image1.jpeg
+image1.jpg
+image1.raw
+image2.jpeg
+image2.jpg
+image3.jpg
+type:LNK
+
+extSubDir:
+external-linked.txt
+
+subDir1:
+file3.flac
+file3.mp3
+fileA.mp3
+pipe
+socket
+subSubDir1
+
+subDir1/subSubDir1:
+
+subDir2:
+file4.flac
+file4.mp3
+fileA.mp3
+EOF
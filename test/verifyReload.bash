@@ -0,0 +1,52 @@
+#!/bin/bash
+
+cd $(dirname "$0")
+. verifyPrelude.bash
+
+# Start out hiding the mp3 files, then switch to hiding the flac files
+CONFIG="$PWD"/verifyReload.$$.rc
+echo '.*\.mp3$' > "$CONFIG"
+"$EXE" $MNT -f -o source="$PWD"/sourceDir -o config="$CONFIG" &
+PID=$!
+for ((i = 0; i < 50; i++)); do
+    ls $MNT/file1.flac >/dev/null 2>&1 && break
+    sleep 0.1
+done
+
+echo '.*\.flac$' > "$CONFIG"
+kill -HUP $PID
+for ((i = 0; i < 100; i++)); do
+    ls $MNT/file1.mp3 >/dev/null 2>&1 && ! ls $MNT/file1.flac >/dev/null 2>&1 && break
+    sleep 0.1
+done
+rm -f "$CONFIG"
+
+. verifyPostlude.bash <<EOF
+external-linked.txt
+file1.mp3
+file2.mp3
+file3.mp3
+image1.jpeg
+image1.jpg
+image1.raw
+image2.jpeg
+image2.jpg
+image3.jpg
+type:LNK
+
+extSubDir:
+external-linked.txt
+
+subDir1:
+file3.mp3
+fileA.mp3
+pipe
+socket
+subSubDir1
+
+subDir1/subSubDir1:
+
+subDir2:
+file4.mp3
+fileA.mp3
+EOF
@@ -0,0 +1,32 @@
+#!/bin/bash
+
+cd $(dirname "$0")
+. verifyPrelude.bash
+REPLAY="$(dirname "$EXE")"/rofs-filtered-replay
+
+# Record a scan of the mount (kept out of the mounted tree, and removed along
+# with it), then play it back: everything the scan saw is still there
+TRACE="$PWD"/sourceDir2/scan.trace
+"$EXE" $MNT -o source="$PWD"/sourceDir -o config="$SRC"/rofs-filtered.rc -o trace="$TRACE"
+ls -lR $MNT >/dev/null
+sleep 0.1
+RESULT=$("$REPLAY" "$TRACE" $MNT)
+if ! echo "$RESULT" | grep -q '"opendir": {"calls": [1-9][0-9]*, "errors": 0,' \
+        || ! echo "$RESULT" | grep -q '"getattr": {"calls": [1-9]'; then
+    fail "The scan did not replay: $RESULT"
+fi
+
+. verifyPostlude.bash <<EOF
+file1.mp3
+file2.mp3
+image1.raw
+image2.jpeg
+image3.jpg
+
+subDir1:
+file3.mp3
+fileA.mp3
+subSubDir1
+
+subDir1/subSubDir1:
+EOF
@@ -0,0 +1,54 @@
+#!/bin/bash
+
+cd $(dirname "$0")
+. verifyPrelude.bash
+
+# Two views of the same source, each with the rules of another test
+"$EXE" $MNT -o source="$PWD"/sourceDir -o view=filtered:"$SRC"/rofs-filtered.rc \
+    -o view=priority:"$SRC"/test/verifyExtensionPriority.rc
+if ls $MNT/subDir1 >/dev/null 2>&1 || [ "$(ls $MNT | tr '\n' ' ')" != "filtered priority " ]; then
+    fail "The root has more than the views in it: $(ls $MNT)"
+fi
+
+. verifyPostlude.bash <<EOF
+filtered:
+file1.mp3
+file2.mp3
+image1.raw
+image2.jpeg
+image3.jpg
+subDir1
+
+filtered/subDir1:
+file3.mp3
+fileA.mp3
+subSubDir1
+
+filtered/subDir1/subSubDir1:
+
+priority:
+extSubDir
+external-linked.txt
+file1.flac
+file2.mp3
+file3.mp3
+image1.raw
+image2.jpeg
+image3.jpg
+subDir1
+subDir2
+type:LNK
+
+priority/subDir1:
+file3.flac
+fileA.mp3
+pipe
+socket
+subSubDir1
+
+priority/subDir1/subSubDir1:
+
+priority/subDir2:
+file4.flac
+fileA.mp3
+EOF
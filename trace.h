@@ -0,0 +1,82 @@
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+/**
+The file the trace option records the callbacks in, and rofs-filtered-replay
+plays back. A header, then one record per call in the order the calls ended,
+each followed by the path it was made on.
+
+trace_reader trace;
+trace_format::record r;
+std::string path;
+if (trace.open("/tmp/plex.trace") == 0) {
+    while (trace.next(r, path)) {
+        // r.op is one of the OP_* calls of common.h
+    }
+}
+*/
+
+namespace trace_format {
+    static const char magic[8] = { 'R', 'O', 'F', 'S', 'T', 'R', 'C', '1' };
+    static const uint32_t byte_order = 0x01020304;
+
+    struct header {
+        char magic[8];
+        uint32_t byte_order;
+        uint32_t reserved;
+        int64_t start_sec;      //< Wall clock time the trace was started at
+        int64_t start_nsec;
+    };
+
+    struct record {
+        uint64_t start_ns;      //< Since the trace was started
+        uint64_t offset;        //< Where read and readdir start, the flags of open, the mode of access
+        uint32_t size;          //< What read asks for, the buffer size of getxattr and listxattr
+        uint32_t duration_ns;   //< Capped at UINT32_MAX
+        uint16_t path_len;      //< The path follows, without a terminating NUL
+        uint8_t op;
+        uint8_t reserved[5];
+    };
+
+    static_assert(sizeof(record) == 32, "trace records must be packed");
+}
+
+class trace_reader {
+public:
+    trace_reader() : f(NULL) {}
+    ~trace_reader() { if (f) fclose(f); }
+
+    /** @return 0, -EINVAL if the file isn't a trace, or another -errno */
+    int open(const std::string &file) {
+        f = fopen(file.c_str(), "rbe");
+        if (f == NULL) return -errno;
+        if (fread(&head, sizeof(head), 1, f) != 1
+                || memcmp(head.magic, trace_format::magic, sizeof(head.magic)) != 0
+                || head.byte_order != trace_format::byte_order) {
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    const trace_format::header &header() const { return head; }
+
+    /** Read the next call, if there is one and it was written out in full */
+    bool next(trace_format::record &r, std::string &path) {
+        if (fread(&r, sizeof(r), 1, f) != 1) return false;
+        path.resize(r.path_len);
+        return r.path_len == 0 || fread(&path[0], r.path_len, 1, f) == 1;
+    }
+
+    trace_reader(const trace_reader&) = delete;
+    void operator = (const trace_reader&) = delete;
+
+private:
+    FILE *f;
+    trace_format::header head;
+};
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <liburing.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <errno.h>
+#include <stddef.h>
+
+/**
+One io_uring shared by any number of submitting threads. A background thread
+reaps the completions and hands each result (-errno on failure) to the
+function given with the request, so the submitter doesn't have to wait for it.
+At most "depth" requests are in flight, submit() waits for a free slot.
+
+If waiting for completions fails for good, the requests in flight are failed
+with that error, and the queue turns new ones away (submit() and run_all()
+return false) so the callers make the calls themselves.
+
+uring_queue ring;
+if (ring.start(256, [](int err) { ... }) == 0) {
+    ring.submit([&](io_uring_sqe *sqe) {
+        io_uring_prep_read(sqe, fd, buf, size, offset);
+    }, [=](int res) {
+        // runs on the reaper thread, must not submit()
+    });
+}
+ring.stop();
+*/
+
+class uring_queue {
+public:
+    uring_queue() : running(false), failed(false), in_flight(0), depth(0) {
+    }
+    ~uring_queue() { stop(); }
+
+    /** @param on_failure Called on the reaper thread with the -errno waiting
+     * for completions failed with, if it ever does
+     * @return 0, or the -errno io_uring_queue_init() failed with */
+    int start(unsigned entries, std::function<void(int)> on_failure = nullptr) {
+        int res = io_uring_queue_init(entries, &ring, 0);
+        if (res < 0) return res;
+
+        depth = entries;
+        failure = std::move(on_failure);
+        failed = false;
+        reaper = std::thread([this]() { reap(); });
+        running.store(true, std::memory_order_release);
+        return 0;
+    }
+
+    /** Wait for the requests in flight and tear the ring down. Must not race
+     * with submit() or run_all(). */
+    void stop() {
+        if (!reaper.joinable()) return;
+        running.store(false, std::memory_order_release);
+
+        {
+            // A request without a completion function tells reap() to quit,
+            // unless it already has
+            std::lock_guard<std::mutex> guard(lock);
+            if (!failed) {
+                io_uring_sqe *sqe = get_sqe();
+                io_uring_prep_nop(sqe);
+                io_uring_sqe_set_data(sqe, NULL);
+                io_uring_submit(&ring);
+            }
+        }
+        reaper.join();
+        // fail() has torn it down already
+        if (!failed) io_uring_queue_exit(&ring);
+    }
+
+    bool is_running() const { return running.load(std::memory_order_acquire); }
+
+    /** Fill in a request with "prep(io_uring_sqe *)" and submit it. "done(int)"
+     * is called with its result once it completes.
+     * @return false if the ring isn't running, and nothing was submitted. */
+    template<class Prep, class Done>
+    bool submit(Prep &&prep, Done &&done) {
+        if (!is_running()) return false;
+
+        op *request = new fn_op<typename std::decay<Done>::type>(std::forward<Done>(done));
+        std::unique_lock<std::mutex> guard(lock);
+        if (!acquire_slot(guard)) {
+            delete request;
+            return false;
+        }
+        io_uring_sqe *sqe = get_sqe();
+        prep(sqe);
+        io_uring_sqe_set_data(sqe, request);
+        link(request);
+        io_uring_submit(&ring);
+        return true;
+    }
+
+    /** Fill in "count" requests with "prep(io_uring_sqe *, size_t i)", submit
+     * them together and wait until all of them have completed.
+     * @param results Receives the result of each request
+     * @return false if the ring isn't running, or stopped working before all
+     * the requests completed: the requests have to be made again. */
+    template<class Prep>
+    bool run_all(size_t count, Prep &&prep, int *results) {
+        if (!is_running()) return false;
+
+        batch requested(count);
+        std::vector<batch_op> requests(count, batch_op(&requested));
+        bool ok = true;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            for (size_t i = 0; i < count; i++) {
+                requests[i].result = &results[i];
+                if (!acquire_slot(guard)) {
+                    // Only wait for the ones already in the ring
+                    std::lock_guard<std::mutex> batch_guard(requested.lock);
+                    requested.remaining -= count - i;
+                    ok = false;
+                    break;
+                }
+                io_uring_sqe *sqe = get_sqe();
+                prep(sqe, i);
+                io_uring_sqe_set_data(sqe, &requests[i]);
+                link(&requests[i]);
+            }
+            if (ok) io_uring_submit(&ring);
+        }
+
+        std::unique_lock<std::mutex> guard(requested.lock);
+        requested.done.wait(guard, [&]() { return requested.remaining == 0; });
+        guard.unlock();
+
+        std::lock_guard<std::mutex> failed_guard(lock);
+        return ok && !failed;
+    }
+
+    uring_queue(const uring_queue&) = delete;
+    void operator = (const uring_queue&) = delete;
+
+private:
+    struct op {
+        virtual ~op() {}
+        virtual void complete(int res) = 0;
+        op *prev, *next;    //< In "pending", guarded by "lock"
+    };
+
+    /** The head of a circular list of requests */
+    struct op_list : op {
+        op_list() { prev = next = this; }
+        void complete(int) override {}
+    };
+
+    template<class Done>
+    struct fn_op : op {
+        explicit fn_op(Done &&done) : done(std::move(done)) {}
+        explicit fn_op(const Done &done) : done(done) {}
+        void complete(int res) override { done(res); delete this; }
+        Done done;
+    };
+
+    struct batch {
+        explicit batch(size_t count) : remaining(count) {}
+        std::mutex lock;
+        std::condition_variable done;
+        size_t remaining;
+    };
+
+    struct batch_op : op {
+        explicit batch_op(batch *requested) : requested(requested), result(NULL) {}
+        void complete(int res) override {
+            *result = res;
+            std::lock_guard<std::mutex> guard(requested->lock);
+            if (--requested->remaining == 0) requested->done.notify_one();
+        }
+        batch *requested;
+        int *result;
+    };
+
+    /** Called with "lock" held */
+    void link(op *request) {
+        request->next = &pending;
+        request->prev = pending.prev;
+        pending.prev->next = request;
+        pending.prev = request;
+    }
+
+    /** Called with "lock" held */
+    static void unlink(op *request) {
+        request->prev->next = request->next;
+        request->next->prev = request->prev;
+    }
+
+    /** Called with "lock" held */
+    io_uring_sqe *get_sqe() {
+        io_uring_sqe *sqe;
+        while ((sqe = io_uring_get_sqe(&ring)) == NULL) io_uring_submit(&ring);
+        return sqe;
+    }
+
+    /** Wait until fewer than "depth" requests are in flight, so the completion
+     * queue (twice as large) can't overflow.
+     * @return false if the ring stopped working */
+    bool acquire_slot(std::unique_lock<std::mutex> &guard) {
+        while (in_flight >= depth && !failed) {
+            // What was prepared so far has to go out for slots to free up
+            io_uring_submit(&ring);
+            slot_free.wait(guard);
+        }
+        if (failed) return false;
+        in_flight++;
+        return true;
+    }
+
+    void reap() {
+        bool quit = false;
+        for (;;) {
+            io_uring_cqe *cqe;
+            int res = io_uring_wait_cqe(&ring, &cqe);
+            if (res == -EINTR) continue;
+            if (res < 0) {
+                fail(res);
+                return;
+            }
+
+            op *request = (op *)io_uring_cqe_get_data(cqe);
+            res = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+
+            std::unique_lock<std::mutex> guard(lock);
+            if (request == NULL) {
+                quit = true;
+            } else {
+                unlink(request);
+                guard.unlock();
+                request->complete(res);
+                guard.lock();
+                in_flight--;
+                slot_free.notify_one();
+            }
+            if (quit && in_flight == 0) return;
+        }
+    }
+
+    /** Give up on the ring: fail everything in it with "err" and turn the
+     * new requests away */
+    void fail(int err) {
+        running.store(false, std::memory_order_release);
+        op_list lost;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            failed = true;
+            in_flight = 0;
+            // The lost requests were submitted, and the kernel could still
+            // write their results and data into the buffers their completion
+            // releases (or the run_all() caller does, once it returns). Tearing
+            // the ring down cancels them, so it has to come first. Nothing
+            // touches the ring once "failed" is set.
+            io_uring_queue_exit(&ring);
+            if (pending.next != &pending) {
+                lost.next = pending.next;
+                lost.prev = pending.prev;
+                lost.next->prev = lost.prev->next = &lost;
+                pending.next = pending.prev = &pending;
+            }
+            slot_free.notify_all();
+        }
+        if (failure) failure(err);
+        while (lost.next != &lost) {
+            op *request = lost.next;
+            unlink(request);
+            request->complete(err);
+        }
+    }
+
+    io_uring ring;
+    std::thread reaper;
+    std::atomic<bool> running;
+    std::function<void(int)> failure;
+    std::mutex lock;                    //< Guards the submission queue, pending, failed and in_flight
+    std::condition_variable slot_free;
+    bool failed;                        //< Waiting for completions failed, the ring is of no use
+    op_list pending;                    //< The requests in flight
+    unsigned in_flight;
+    unsigned depth;
+};
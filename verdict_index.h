@@ -0,0 +1,260 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+/**
+A file that maps path hashes to a hide/show verdict, along with the mtime of
+the directory each path was found in. Written once by verdict_index_writer,
+then memory-mapped read-only by verdict_index, so opening even a large one
+costs nothing until it's used.
+
+verdict_index_writer writer;
+uint32_t dir = writer.add_dir(dir_st.st_mtim);
+writer.add(verdict_hash("/some/file", 10), dir, S_IFREG, true);
+writer.write("/var/cache/rofs.index", fingerprint);
+
+verdict_index index;
+verdict_index::entry e;
+if (index.open("/var/cache/rofs.index") == 0 && index.find(verdict_hash("/some/file", 10), e)) {
+    // e.hide, valid if index.dir_mtime(e.dir) is still the directory's mtime
+}
+*/
+
+/** 64 bit FNV-1a, what verdict_index files are keyed by. Never 0. */
+static inline uint64_t verdict_hash(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+namespace verdict_index_format {
+    static const char magic[8] = { 'R', 'O', 'F', 'S', 'I', 'D', 'X', '1' };
+    static const uint32_t byte_order = 0x01020304;
+
+    struct header {
+        char magic[8];
+        uint32_t byte_order;
+        uint32_t reserved;
+        uint64_t fingerprint;   //< Identifies the rules the verdicts were computed with
+        uint64_t slot_count;    //< A power of two
+        uint64_t dir_count;
+    };
+
+    /** An open addressing hash table slot, all zeros if empty */
+    struct slot {
+        uint32_t hash_lo;
+        uint32_t hash_hi;
+        uint32_t info;          //< dir | type << dir_bits | hide flag | collision flag
+    };
+
+    struct dir {
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+    };
+
+    static const unsigned dir_bits = 26;
+    static const uint32_t dir_mask = (1u << dir_bits) - 1;
+    static const uint32_t hide_flag = 1u << 30;
+    static const uint32_t collision_flag = 1u << 31;   //< Two paths share the hash, don't trust it
+    static const size_t max_dirs = dir_mask + 1;
+}
+
+class verdict_index_writer {
+public:
+    /** @return The id of the directory, or -1 if there are too many of them */
+    int64_t add_dir(const struct timespec &mtime) {
+        if (dirs.size() >= verdict_index_format::max_dirs) return -1;
+        dirs.push_back({ (int64_t)mtime.tv_sec, (int64_t)mtime.tv_nsec });
+        return dirs.size() - 1;
+    }
+
+    void add(uint64_t hash, uint32_t dir, mode_t mode, bool hide) {
+        uint32_t info = dir | ((uint32_t)(mode & S_IFMT) >> 12) << verdict_index_format::dir_bits;
+        if (hide) info |= verdict_index_format::hide_flag;
+        entries.push_back({ (uint32_t)hash, (uint32_t)(hash >> 32), info });
+    }
+
+    size_t size() const { return entries.size(); }
+
+    /** Write the table to "file", replacing it atomically.
+     * @return 0, or -errno */
+    int write(const std::string &file, uint64_t fingerprint) const {
+        using namespace verdict_index_format;
+
+        // Keep the table at most 3/4 full, so probe sequences stay short
+        uint64_t slot_count = 16;
+        while (slot_count < entries.size() + entries.size() / 3 + 1) slot_count *= 2;
+
+        std::vector<slot> slots(slot_count);
+        for (const auto &e : entries) {
+            uint64_t hash = (uint64_t)e.hash_hi << 32 | e.hash_lo;
+            for (uint64_t i = hash & (slot_count - 1); ; i = (i + 1) & (slot_count - 1)) {
+                slot &s = slots[i];
+                if (s.hash_lo == 0 && s.hash_hi == 0) {
+                    s = e;
+                    break;
+                }
+                if (s.hash_lo == e.hash_lo && s.hash_hi == e.hash_hi) {
+                    s.info |= collision_flag;
+                    break;
+                }
+            }
+        }
+
+        header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, magic, sizeof(h.magic));
+        h.byte_order = byte_order;
+        h.fingerprint = fingerprint;
+        h.slot_count = slot_count;
+        h.dir_count = dirs.size();
+
+        std::string tmp = file + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) return -errno;
+
+        int res = 0;
+        if (!write_all(fd, &h, sizeof(h))
+                || !write_all(fd, slots.data(), slots.size() * sizeof(slot))
+                || !write_all(fd, dirs.data(), dirs.size() * sizeof(dir))
+                || fsync(fd)) {
+            res = -errno;
+        }
+        if (close(fd) && res == 0) res = -errno;
+        if (res == 0 && rename(tmp.c_str(), file.c_str())) res = -errno;
+        if (res) unlink(tmp.c_str());
+        return res;
+    }
+
+private:
+    static bool write_all(int fd, const void *data, size_t size) {
+        const char *p = (const char *)data;
+        while (size) {
+            ssize_t n = ::write(fd, p, size);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    std::vector<verdict_index_format::slot> entries;
+    std::vector<verdict_index_format::dir> dirs;
+};
+
+class verdict_index {
+public:
+    struct entry {
+        uint32_t dir;
+        mode_t mode;    //< Only the file type bits
+        bool hide;
+    };
+
+    verdict_index() : map(NULL), map_size(0), hdr(NULL), slots(NULL), dirs(NULL) {}
+    ~verdict_index() { if (map) munmap(map, map_size); }
+
+    /** Map "file" into memory.
+     * @return 0, or -errno (-EINVAL if it isn't a valid index file) */
+    int open(const std::string &file) {
+        using namespace verdict_index_format;
+
+        int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return -errno;
+
+        struct stat st;
+        if (fstat(fd, &st)) {
+            int res = -errno;
+            close(fd);
+            return res;
+        }
+        if ((size_t)st.st_size < sizeof(header)) {
+            close(fd);
+            return -EINVAL;
+        }
+
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (m == MAP_FAILED) return -errno;
+
+        const header *h = (const header *)m;
+        bool valid = memcmp(h->magic, magic, sizeof(magic)) == 0 && h->byte_order == byte_order
+            && h->slot_count && (h->slot_count & (h->slot_count - 1)) == 0
+            && h->dir_count <= max_dirs
+            && (uint64_t)st.st_size == sizeof(header) + h->slot_count * sizeof(slot) + h->dir_count * sizeof(dir);
+        if (!valid) {
+            munmap(m, st.st_size);
+            return -EINVAL;
+        }
+
+        if (map) munmap(map, map_size);
+        map = m;
+        map_size = st.st_size;
+        hdr = h;
+        slots = (const slot *)(hdr + 1);
+        dirs = (const dir *)(slots + hdr->slot_count);
+        return 0;
+    }
+
+    uint64_t fingerprint() const { return hdr->fingerprint; }
+    size_t dir_count() const { return hdr->dir_count; }
+
+    /** @return false if the hash isn't in the index, or can't be trusted */
+    bool find(uint64_t hash, entry &e) const {
+        using namespace verdict_index_format;
+
+        const uint32_t lo = (uint32_t)hash, hi = (uint32_t)(hash >> 32);
+        const uint64_t mask = hdr->slot_count - 1;
+        for (uint64_t n = 0, i = hash & mask; n <= mask; n++, i = (i + 1) & mask) {
+            const slot &s = slots[i];
+            if (s.hash_lo == lo && s.hash_hi == hi) {
+                if (s.info & collision_flag) return false;
+                e.dir = s.info & dir_mask;
+                e.mode = ((s.info >> dir_bits) & 0xf) << 12;
+                e.hide = s.info & hide_flag;
+                return e.dir < hdr->dir_count;
+            }
+            if (s.hash_lo == 0 && s.hash_hi == 0) return false;
+        }
+        return false;
+    }
+
+    /** The mtime of the directory when the index was built */
+    struct timespec dir_mtime(uint32_t dir) const {
+        struct timespec ts;
+        ts.tv_sec = dirs[dir].mtime_sec;
+        ts.tv_nsec = dirs[dir].mtime_nsec;
+        return ts;
+    }
+
+    verdict_index(const verdict_index&) = delete;
+    void operator = (const verdict_index&) = delete;
+
+private:
+    typedef verdict_index_format::header header;
+    typedef verdict_index_format::slot slot;
+    typedef verdict_index_format::dir dir;
+
+    void *map;
+    size_t map_size;
+    const header *hdr;
+    const slot *slots;
+    const dir *dirs;
+};
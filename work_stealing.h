@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+Runs tasks that create more tasks (directories to walk, for instance) on a
+fixed number of threads. Each thread works off its own queue, newest task
+first, steals the oldest task of another thread when it runs out, and sleeps
+when there is nothing to steal.
+
+work_stealing_pool<std::string>::run(8, { "/" }, [&](std::string &dir, auto &&push) {
+    // list dir, then for every subdirectory:
+    push(subdir);
+});
+*/
+
+template<class Task>
+class work_stealing_pool {
+public:
+    /** Call "work(Task &, push)" for every task, starting with "tasks". The
+     * tasks passed to "push(Task)" are run as well. Returns once all of them
+     * are done. */
+    template<class Work>
+    static void run(unsigned threads, std::vector<Task> tasks, Work &&work) {
+        if (threads == 0) threads = 1;
+
+        work_stealing_pool pool(threads);
+        for (size_t i = 0; i < tasks.size(); i++) {
+            pool.queues[i % threads]->tasks.push_back(std::move(tasks[i]));
+        }
+        pool.pending.store(tasks.size(), std::memory_order_relaxed);
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; i++) {
+            workers.emplace_back([&pool, &work, i]() { pool.serve(i, work); });
+        }
+        pool.serve(0, work);
+        for (auto &t : workers) t.join();
+    }
+
+    work_stealing_pool(const work_stealing_pool&) = delete;
+    void operator = (const work_stealing_pool&) = delete;
+
+private:
+    struct queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    explicit work_stealing_pool(unsigned threads) : pending(0), idle(0) {
+        for (unsigned i = 0; i < threads; i++) queues.emplace_back(new queue());
+    }
+
+    template<class Work>
+    void serve(unsigned self, Work &work) {
+        auto push = [this, self](Task task) {
+            // Counted before the task that pushes it is done, so "pending"
+            // only drops to zero once there's nothing left anywhere.
+            pending.fetch_add(1, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> guard(queues[self]->lock);
+                queues[self]->tasks.push_back(std::move(task));
+            }
+            // A worker that went to sleep after taking the queue lock above
+            // counted itself in "idle" before looking at the queue
+            if (idle.load()) {
+                std::lock_guard<std::mutex> guard(idle_lock);
+                idle_cond.notify_one();
+            }
+        };
+
+        Task task;
+        while (next(self, task)) {
+            work(task, push);
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                std::lock_guard<std::mutex> guard(idle_lock);
+                idle_cond.notify_all();
+            }
+        }
+    }
+
+    /** Take a task, or wait for one to be pushed while there are some
+     * running. Returns false once all of them are done. */
+    bool next(unsigned self, Task &task) {
+        if (take(self, task)) return true;
+
+        std::unique_lock<std::mutex> guard(idle_lock);
+        idle.fetch_add(1);
+        bool found;
+        while (!(found = take(self, task)) && pending.load(std::memory_order_acquire) != 0) {
+            idle_cond.wait(guard);
+        }
+        idle.fetch_sub(1);
+        return found;
+    }
+
+    bool take(unsigned self, Task &task) {
+        {
+            queue &own = *queues[self];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t n = 1; n < queues.size(); n++) {
+            queue &other = *queues[(self + n) % queues.size()];
+            std::lock_guard<std::mutex> guard(other.lock);
+            if (!other.tasks.empty()) {
+                task = std::move(other.tasks.front());
+                other.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<queue>> queues;
+    std::atomic<size_t> pending;    //< Tasks queued or running
+
+    std::mutex idle_lock;
+    std::condition_variable idle_cond;  //< Signaled when a task is pushed, or the last one is done
+    std::atomic<unsigned> idle;         //< Workers waiting on idle_cond
+};